@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+/// @brief Reading and writing of the binary files of the indexes and caches. Values are stored
+/// raw, in the byte order of the machine, strings and lists with their length in front. Files are
+/// written to a temporary file first and then renamed, such that readers never see a partial
+/// file. Readers check the stream state once after reading, all reads after a failed one do
+/// nothing.
+namespace binaryio {
+
+/// @brief Size and modification time of a file
+using FileStat = std::pair<std::uint64_t, std::int64_t>;
+
+/// @brief Size and modification time of a file, nothing if it does not exist.
+/// @param filename
+/// @return
+[[nodiscard]] inline std::optional<FileStat> stat(const std::string &filename) {
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(filename, ec);
+
+    if (ec) {
+        return std::nullopt;
+    }
+
+    const auto mtime = std::filesystem::last_write_time(filename, ec);
+
+    if (ec) {
+        return std::nullopt;
+    }
+
+    return FileStat(size, mtime.time_since_epoch().count());
+}
+
+template <typename T>
+void read(std::istream &in, T &value) {
+    in.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+template <typename T>
+void write(std::ostream &out, const T &value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+/// @brief Read a string written by write_string().
+/// @param in
+/// @param str
+/// @param max_length longer strings only appear in corrupt files, and fail the stream
+inline void read_string(std::istream &in, std::string &str, std::uint32_t max_length) {
+    std::uint32_t length = 0;
+    read(in, length);
+
+    if (length > max_length) {
+        in.setstate(std::ios::failbit);
+    }
+
+    if (!in) {
+        return;
+    }
+
+    str.resize(length);
+    in.read(str.data(), length);
+}
+
+inline void write_string(std::ostream &out, std::string_view str) {
+    write(out, std::uint32_t(str.size()));
+    out.write(str.data(), str.size());
+}
+
+/// @brief Read a list of strings written by write_strings().
+/// @param in
+/// @param strs
+/// @param max_length bounds the number of strings as well as their lengths
+inline void read_strings(std::istream &in, std::vector<std::string> &strs,
+                         std::uint32_t max_length) {
+    std::uint64_t count = 0;
+    read(in, count);
+
+    if (count > max_length) {
+        in.setstate(std::ios::failbit);
+    }
+
+    for (std::uint64_t i = 0; i < count && in; i++) {
+        read_string(in, strs.emplace_back(), max_length);
+    }
+}
+
+inline void write_strings(std::ostream &out, const std::vector<std::string> &strs) {
+    write(out, std::uint64_t(strs.size()));
+
+    for (const auto &str : strs) {
+        write_string(out, str);
+    }
+}
+
+/// @brief Read the magic string at the start of a file and compare it.
+/// @param in
+/// @param magic
+/// @return
+[[nodiscard]] inline bool read_magic(std::istream &in, std::string_view magic) {
+    std::string found(magic.size(), '\0');
+    in.read(found.data(), found.size());
+
+    return in && found == magic;
+}
+
+/// @brief Write a file through a temporary file next to it, which replaces the file only once it
+/// is written completely.
+/// @param filename
+/// @param write_content writes the content to the given std::ostream
+/// @return
+template <typename Function>
+bool write_atomic(const std::string &filename, Function &&write_content) {
+    const std::string tmp = filename + ".tmp";
+
+    std::ofstream out(tmp, std::ios::binary);
+    write_content(static_cast<std::ostream &>(out));
+
+    // the last buffered bytes are only written by close(), which fails the stream on errors
+    out.close();
+
+    std::error_code ec;
+
+    if (!out) {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+
+    std::filesystem::rename(tmp, filename, ec);
+
+    return !ec;
+}
+
+}  // namespace binaryio
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "binaryio.hpp"
+#include "external/threadpool.hpp"
+#include "scoreWDLstat.hpp"
+
+/// @brief Discovery of the pgn files in a directory tree. The directories of each level of the
+/// tree are listed in parallel, and the type of each entry is taken from the directory listing
+/// itself, which avoids a stat per file on file systems that report it. A manifest can remember
+/// the listing of every directory together with its modification time. Creating, deleting or
+/// renaming an entry changes the modification time of its directory, so the listings of
+/// directories with an unchanged modification time are reused, and only these directories, not
+/// their files, need a stat.
+namespace crawler {
+
+/// @brief The pgn files and subdirectories of a directory, by name
+struct Listing {
+    std::int64_t mtime = 0;
+    std::vector<std::string> files;
+    std::vector<std::string> directories;
+
+    bool operator==(const Listing &other) const {
+        return mtime == other.mtime && files == other.files && directories == other.directories;
+    }
+
+    bool operator!=(const Listing &other) const { return !(*this == other); }
+};
+
+class Manifest {
+   public:
+    /// @brief Load the manifest from a file, an unreadable or outdated file gives an empty
+    /// manifest.
+    /// @param filename
+    explicit Manifest(const std::string &filename) : filename(filename) {
+        std::ifstream in(filename, std::ios::binary);
+
+        if (!in) {
+            return;
+        }
+
+        std::uint64_t count = 0;
+
+        const bool magic = binaryio::read_magic(in, file_magic);
+        binaryio::read(in, count);
+
+        if (!in || !magic) {
+            return;
+        }
+
+        for (std::uint64_t i = 0; i < count && in; i++) {
+            std::string directory;
+            Listing listing;
+
+            binaryio::read_string(in, directory, max_length);
+            binaryio::read(in, listing.mtime);
+            binaryio::read_strings(in, listing.files, max_length);
+            binaryio::read_strings(in, listing.directories, max_length);
+
+            if (in) {
+                listings.emplace(std::move(directory), std::move(listing));
+            }
+        }
+
+        if (!in) {
+            listings.clear();
+        }
+    }
+
+    /// @brief The listing of a directory, if its modification time did not change.
+    /// @param directory absolute path of the directory
+    /// @param mtime
+    /// @return
+    [[nodiscard]] const Listing *find(const std::string &directory, std::int64_t mtime) const {
+        const auto it = listings.find(directory);
+
+        if (it == listings.end() || it->second.mtime != mtime) {
+            return nullptr;
+        }
+
+        return &it->second;
+    }
+
+    /// @brief Store the listings of a crawl, which replace all listings of the directory tree at
+    /// root if the crawl was recursive.
+    /// @param root
+    /// @param recursive
+    /// @param crawled
+    void update(const std::string &root, bool recursive,
+                std::unordered_map<std::string, Listing> crawled) {
+        const auto prefix = (std::filesystem::path(root) / "").string();
+
+        for (auto it = listings.begin(); recursive && it != listings.end();) {
+            if ((it->first == root || it->first.rfind(prefix, 0) == 0) &&
+                crawled.count(it->first) == 0) {
+                it      = listings.erase(it);
+                changed = true;
+            } else {
+                ++it;
+            }
+        }
+
+        for (auto &[directory, listing] : crawled) {
+            const auto it = listings.find(directory);
+
+            if (it == listings.end() || it->second != listing) {
+                listings.insert_or_assign(directory, std::move(listing));
+                changed = true;
+            }
+        }
+    }
+
+    /// @brief Write the manifest back to its file, if anything changed.
+    /// @return
+    bool save() const {
+        if (!changed) {
+            return true;
+        }
+
+        return binaryio::write_atomic(filename, [this](std::ostream &out) {
+            out.write(file_magic.data(), file_magic.size());
+            binaryio::write(out, std::uint64_t(listings.size()));
+
+            for (const auto &[directory, listing] : listings) {
+                binaryio::write_string(out, directory);
+                binaryio::write(out, listing.mtime);
+                binaryio::write_strings(out, listing.files);
+                binaryio::write_strings(out, listing.directories);
+            }
+        });
+    }
+
+   private:
+    static constexpr std::string_view file_magic = "WDLMANI1";
+    // longer names or lists only appear in a corrupt manifest
+    static constexpr std::uint32_t max_length = 1 << 24;
+
+    std::string filename;
+    std::unordered_map<std::string, Listing> listings;
+    bool changed = false;
+};
+
+/// @brief Check if a file name is the one of a .pgn or .pgn.gz file.
+/// @param name
+/// @return
+[[nodiscard]] inline bool is_pgn(std::string_view name) {
+    return ends_with(name, ".pgn") || ends_with(name, ".pgn.gz");
+}
+
+/// @brief List a directory. The member functions of directory_entry use the file type of the
+/// directory listing where the platform provides it, and only stat symlinks and entries of
+/// unknown type.
+/// @param directory
+/// @param mtime
+/// @param ec set if the directory could not be listed completely
+/// @return
+[[nodiscard]] inline Listing list(const std::string &directory, std::int64_t mtime,
+                                  std::error_code &ec) {
+    Listing listing;
+    listing.mtime = mtime;
+
+    for (std::filesystem::directory_iterator it(directory, ec), end; !ec && it != end;
+         it.increment(ec)) {
+        const auto &entry = *it;
+        auto name         = entry.path().filename().string();
+        std::error_code type_ec;
+
+        if (entry.is_regular_file(type_ec)) {
+            if (is_pgn(name)) {
+                listing.files.push_back(std::move(name));
+            }
+        } else if (entry.is_directory(type_ec)) {
+            listing.directories.push_back(std::move(name));
+        }
+    }
+
+    // an incomplete listing must not be reused
+    if (ec) {
+        listing.mtime = 0;
+    }
+
+    return listing;
+}
+
+/// @brief The pgn files found by a crawl, and the directories that could not be listed
+struct Crawl {
+    std::vector<std::string> files;
+    std::vector<std::pair<std::string, std::error_code>> errors;
+};
+
+/// @brief Find all .pgn and .pgn.gz files in a directory, and optionally in its subdirectories.
+/// @param root
+/// @param recursive
+/// @param concurrency number of directories listed in parallel
+/// @param manifest if given, listings of unchanged directories are taken from it, and it is
+/// updated with the listings of this crawl
+/// @return the files, which miss the ones of the directories in errors if there are any
+[[nodiscard]] inline Crawl crawl(const std::string &root, bool recursive, int concurrency,
+                                 Manifest *manifest = nullptr) {
+    // a directory modified this recently may still change within the resolution of its
+    // modification time, its listing is not trusted by later runs
+    const auto racy = std::filesystem::file_time_type::clock::now() - std::chrono::seconds(2);
+
+    // the manifest is keyed by absolute paths, which do not depend on the working directory
+    const auto absolute = [](const std::string &directory) {
+        std::error_code ec;
+        return std::filesystem::absolute(directory, ec).lexically_normal().string();
+    };
+
+    std::unordered_map<std::string, Listing> crawled;
+    Crawl result;
+    std::vector<std::string> level = {root};
+
+    while (!level.empty()) {
+        std::vector<Listing> listings(level.size());
+        std::vector<std::error_code> errors(level.size());
+
+        {
+            ThreadPool pool(std::max(1, std::min(concurrency, int(level.size()))));
+
+            for (std::size_t i = 0; i < level.size(); i++) {
+                pool.enqueue([&level, &listings, &errors, &absolute, manifest, racy, i]() {
+                    auto &ec         = errors[i];
+                    const auto mtime = std::filesystem::last_write_time(level[i], ec);
+
+                    if (ec) {
+                        return;
+                    }
+
+                    const auto stamp = mtime < racy ? mtime.time_since_epoch().count() : 0;
+
+                    if (manifest != nullptr && stamp != 0) {
+                        if (const auto *listing = manifest->find(absolute(level[i]), stamp)) {
+                            listings[i] = *listing;
+                            return;
+                        }
+                    }
+
+                    listings[i] = list(level[i], stamp, ec);
+                });
+            }
+
+            pool.wait();
+        }
+
+        std::vector<std::string> next;
+
+        for (std::size_t i = 0; i < level.size(); i++) {
+            const std::filesystem::path directory(level[i]);
+
+            if (errors[i]) {
+                result.errors.emplace_back(level[i], errors[i]);
+            }
+
+            for (const auto &file : listings[i].files) {
+                result.files.push_back((directory / file).string());
+            }
+
+            if (recursive) {
+                for (const auto &subdirectory : listings[i].directories) {
+                    next.push_back((directory / subdirectory).string());
+                }
+            }
+
+            if (manifest != nullptr) {
+                crawled.emplace(absolute(level[i]), std::move(listings[i]));
+            }
+        }
+
+        level = std::move(next);
+    }
+
+    if (manifest != nullptr) {
+        manifest->update(absolute(root), recursive, std::move(crawled));
+    }
+
+    return result;
+}
+
+}  // namespace crawler
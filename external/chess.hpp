@@ -2231,6 +2231,14 @@ class Board {
         setFen(original_fen_);
     }
 
+    /// @brief Set the move counters of the current position, without parsing a new FEN.
+    /// @param half_moves
+    /// @param full_moves
+    void setMoveCounters(std::uint32_t half_moves, std::uint32_t full_moves) {
+        hfm_   = static_cast<uint8_t>(half_moves);
+        plies_ = static_cast<uint16_t>(full_moves * 2 - 2 + (stm_ == Color::BLACK));
+    }
+
     /// @brief Checks if the current position is a chess960, aka. FRC/DFRC position.
     /// @return
     [[nodiscard]] bool chess960() const { return chess960_; }
@@ -3469,10 +3477,65 @@ inline const std::array<std::array<Bitboard, 64>, 64> movegen::SQUARES_BETWEEN_B
 
 }  // namespace chess
 
+#include <cstring>
 #include <istream>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#    include <immintrin.h>
+#endif
+
 namespace chess::pgn {
 
+namespace detail {
+
+#if defined(__AVX2__)
+/// @brief Bit mask of the 32 bytes at begin that are equal to one of the characters Cs.
+template <char... Cs>
+inline unsigned match_mask(const char *begin) {
+    const auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+    auto match       = _mm256_setzero_si256();
+    ((match = _mm256_or_si256(match, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(Cs)))), ...);
+    return static_cast<unsigned>(_mm256_movemask_epi8(match));
+}
+
+constexpr std::ptrdiff_t match_width = 32;
+#elif defined(__SSE2__)
+/// @brief Bit mask of the 16 bytes at begin that are equal to one of the characters Cs.
+template <char... Cs>
+inline unsigned match_mask(const char *begin) {
+    const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+    auto match       = _mm_setzero_si128();
+    ((match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(Cs)))), ...);
+    return static_cast<unsigned>(_mm_movemask_epi8(match));
+}
+
+constexpr std::ptrdiff_t match_width = 16;
+#endif
+
+/// @brief Find the first byte in [begin, end) equal to one of the characters Cs, comparing
+/// 32 (AVX2) or 16 (SSE2) bytes at a time where available.
+/// @return pointer to the byte found, or end
+template <char... Cs>
+inline const char *find_first_of(const char *begin, const char *end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (; end - begin >= match_width; begin += match_width) {
+        if (const auto mask = match_mask<Cs...>(begin)) {
+            return begin + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; begin != end; ++begin) {
+        if (((*begin == Cs) || ...)) {
+            return begin;
+        }
+    }
+
+    return end;
+}
+
+}  // namespace detail
+
 /// @brief Visitor interface for parsing PGN files
 /// the order of the calls is as follows:
 class Visitor {
@@ -3522,7 +3585,8 @@ template <std::size_t BUFFER_SIZE =
           >
 class StreamParser {
    public:
-    StreamParser(std::istream &stream) : stream_buffer(stream) {}
+    StreamParser(std::istream &stream, std::size_t buffer_size = BUFFER_SIZE * BUFFER_SIZE)
+        : stream_buffer(stream, buffer_size) {}
 
     void readGames(Visitor &vis) {
         visitor = &vis;
@@ -3568,6 +3632,15 @@ class StreamParser {
             buffer_[index_++] = c;
         }
 
+        void append(const char *data, std::size_t n) {
+            if (n > N - index_) {
+                throw std::runtime_error("LineBuffer overflow");
+            }
+
+            std::memcpy(buffer_.data() + index_, data, n);
+            index_ += n;
+        }
+
         void remove_suffix(std::size_t n) {
             if (n > index_) {
                 throw std::runtime_error("LineBuffer underflow");
@@ -3584,12 +3657,9 @@ class StreamParser {
     };
 
     class StreamBuffer {
-       private:
-        static constexpr std::size_t N = BUFFER_SIZE;
-        using BufferType               = std::array<char, N * N>;
-
        public:
-        StreamBuffer(std::istream &stream) : stream_(stream) {}
+        StreamBuffer(std::istream &stream, std::size_t buffer_size)
+            : stream_(stream), buffer_(std::max<std::size_t>(buffer_size, game_start.size() + 1)) {}
 
         template <typename FUNC>
         void loop(FUNC f) {
@@ -3655,12 +3725,99 @@ class StreamParser {
             return false;
         }
 
+        /// @brief Move to the start of the next game, i.e. to the newline in front of an [Event tag
+        /// after an empty line, the same marker split_pgn and the gzip index use. Starts with the
+        /// current character, the next advance() then moves onto the '['.
+        /// @param empty_line whether the line before the current character is empty, e.g. at the
+        /// empty line after the headers of a game without moves
+        /// @return false if the end of the stream was reached
+        bool skipToGameStart(bool empty_line) {
+            while (true) {
+                if (buffer_index_ >= bytes_read_ && !fill()) {
+                    return false;
+                }
+
+                if (buffer_[buffer_index_] == '\n') {
+                    if (empty_line && followedBy(game_start)) {
+                        return true;
+                    }
+
+                    empty_line = true;
+                    buffer_index_++;
+                    continue;
+                }
+
+                const char *begin = buffer_.data() + buffer_index_;
+                const auto *nl =
+                    static_cast<const char *>(std::memchr(begin, '\n', bytes_read_ - buffer_index_));
+                const char *end = nl != nullptr ? nl : buffer_.data() + bytes_read_;
+
+                empty_line    = empty_line && std::all_of(begin, end, [](char c) { return c == '\r'; });
+                buffer_index_ = end - buffer_.data();
+            }
+        }
+
+        /// @brief Compare the characters after the current one, without moving. If the buffer
+        /// ends before them, its rest is moved to the front and the buffer is filled up.
+        /// @param str
+        /// @return
+        bool followedBy(std::string_view str) {
+            if (std::size_t(bytes_read_ - buffer_index_) <= str.size() && stream_.good()) {
+                const auto rest = bytes_read_ - buffer_index_;
+
+                std::memmove(buffer_.data(), buffer_.data() + buffer_index_, rest);
+                stream_.read(buffer_.data() + rest, buffer_.size() - rest);
+
+                buffer_index_ = 0;
+                bytes_read_   = rest + stream_.gcount();
+            }
+
+            if (std::size_t(bytes_read_ - buffer_index_) <= str.size()) {
+                return false;
+            }
+
+            return std::string_view(buffer_.data() + buffer_index_ + 1, str.size()) == str;
+        }
+
+        /// @brief Append all characters up to the first of the delimiters to out, skipping '\r'
+        /// like loop() does, such that the delimiter is the current character afterwards.
+        /// Whole spans between delimiters are found with detail::find_first_of and copied at
+        /// once.
+        /// @tparam Delims
+        /// @param out
+        /// @return false if the end of the stream was reached before a delimiter
+        template <char... Delims, typename BUFFER>
+        bool appendUntil(BUFFER &out) {
+            while (true) {
+                if (buffer_index_ >= bytes_read_ && !fill()) {
+                    return false;
+                }
+
+                const char *begin = buffer_.data() + buffer_index_;
+                const char *end   = buffer_.data() + bytes_read_;
+                const char *found = detail::find_first_of<'\r', Delims...>(begin, end);
+
+                out.append(begin, found - begin);
+                buffer_index_ = found - buffer_.data();
+
+                if (found == end) {
+                    continue;
+                }
+
+                if (*found != '\r') {
+                    return true;
+                }
+
+                buffer_index_++;
+            }
+        }
+
         bool fill() {
             if (!stream_.good()) return false;
 
             buffer_index_ = 0;
 
-            stream_.read(buffer_.data(), N * N);
+            stream_.read(buffer_.data(), buffer_.size());
             bytes_read_ = stream_.gcount();
 
             return bytes_read_ > 0;
@@ -3699,8 +3856,11 @@ class StreamParser {
         }
 
        private:
+        // a game starts with this tag after an empty line
+        static constexpr std::string_view game_start = "[Event ";
+
         std::istream &stream_;
-        BufferType buffer_;
+        std::vector<char> buffer_;
         std::streamsize bytes_read_   = 0;
         std::streamsize buffer_index_ = 0;
     };
@@ -3779,6 +3939,12 @@ class StreamParser {
 
                     if (!visitor->skip()) visitor->startMoves();
 
+                    // the visitor is not interested in the moves, jump to the next game
+                    if (visitor->skip()) {
+                        stream_buffer.skipToGameStart(true);
+                        onEnd();
+                    }
+
                     return true;
                 default:
                     break;
@@ -3813,15 +3979,8 @@ class StreamParser {
 
                 // reading comment
                 stream_buffer.advance();
-                stream_buffer.loop([this](char c) {
-                    stream_buffer.advance();
-
-                    if (c == '}') return true;
-
-                    comment += c;
-
-                    return false;
-                });
+                stream_buffer.appendUntil<'}'>(comment);
+                stream_buffer.advance();
 
                 // the game has no moves, but a comment followed by a game termination
                 if (!visitor->skip()) {
@@ -3886,6 +4045,13 @@ class StreamParser {
                 return true;
             }
 
+            // the visitor is done with this game, jump to the next one
+            if (visitor->skip()) {
+                stream_buffer.skipToGameStart(false);
+                onEnd();
+                return true;
+            }
+
             // skip spaces
             stream_buffer.loop([this](char c) {
                 if (is_space(c)) {
@@ -3968,16 +4134,7 @@ class StreamParser {
 
     bool parseMove() {
         // reading move
-        stream_buffer.loop([this](char c) {
-            if (is_space(c)) {
-                return true;
-            }
-
-            move += c;
-
-            stream_buffer.advance();
-            return false;
-        });
+        stream_buffer.appendUntil<' ', '\t', '\n'>(move);
 
     start:
         auto curr = stream_buffer.current();
@@ -3990,15 +4147,8 @@ class StreamParser {
             case '{':
                 // reading comment
                 stream_buffer.advance();
-                stream_buffer.loop([this](char c) {
-                    stream_buffer.advance();
-
-                    if (c == '}') return true;
-
-                    comment += c;
-
-                    return false;
-                });
+                stream_buffer.appendUntil<'}'>(comment);
+                stream_buffer.advance();
                 goto start;
             case '(':
                 stream_buffer.readUntilMatchingDelimiter('(', ')');
@@ -4311,7 +4461,139 @@ class uci {
         throw SanParseError("Failed to parse san. At step 3: " + std::string(san) + " " + board.getFen());
     }
 
+    /// @brief Converts a SAN string to a move, trusting that it is a legal move in the position,
+    /// as in games played by engines. Instead of generating the legal moves, the origin square is
+    /// found among the pieces of the moving type that attack the destination square, and pins are
+    /// only checked when more than one such piece remains. Whenever this does not leave exactly
+    /// one candidate, parseSan decides.
+    /// @param board
+    /// @param san
+    /// @param moves
+    /// @return
+    [[nodiscard]] static Move parseSanTrusted(const Board &board, std::string_view san, Movelist &moves) noexcept(false) {
+        if (san.empty()) {
+            return Move::NO_MOVE;
+        }
+
+        const SanMoveInformation info = parseSanInfo<false>(san);
+        const Color stm               = board.sideToMove();
+
+        if (info.castling_short || info.castling_long) {
+            const auto side   = info.castling_short ? Board::CastlingRights::Side::KING_SIDE
+                                                    : Board::CastlingRights::Side::QUEEN_SIDE;
+            const auto rights = board.castlingRights();
+
+            if (rights.has(stm, side)) {
+                const Square king_sq = board.kingSq(stm);
+                return Move::make<Move::CASTLING>(king_sq, Square(rights.getRookFile(stm, side), king_sq.rank()));
+            }
+
+            return parseSan(board, san, moves);
+        }
+
+        if (!info.to.is_valid()) {
+            return parseSan(board, san, moves);
+        }
+
+        if (info.piece == PieceType::PAWN) {
+            const Bitboard pawns = board.pieces(PieceType::PAWN, stm);
+            const int down       = stm == Color::WHITE ? -8 : 8;
+            const int one        = info.to.index() + down;
+            const int two        = one + down;
+            int from             = -1;
+
+            if (info.capture) {
+                if (info.from_file != File::NO_FILE && one >= 0 && one < 64) {
+                    from = (one & ~7) + int(info.from_file);
+                }
+            } else if (one >= 0 && one < 64 && pawns.check(one)) {
+                from = one;
+            } else if (two >= 0 && two < 64 && !board.occ().check(one)) {
+                from = two;
+            }
+
+            if (from < 0 || !pawns.check(from)) {
+                return parseSan(board, san, moves);
+            }
+
+            if (info.promotion != PieceType::NONE) {
+                return Move::make<Move::PROMOTION>(Square(from), info.to, info.promotion);
+            }
+
+            if (info.capture && info.to == board.enpassantSq()) {
+                return Move::make<Move::ENPASSANT>(Square(from), info.to);
+            }
+
+            return Move::make<Move::NORMAL>(Square(from), info.to);
+        }
+
+        // the pieces of the moving type that attack the destination square
+        Bitboard candidates = board.pieces(info.piece, stm);
+
+        switch (info.piece.internal()) {
+            case PieceType::KNIGHT:
+                candidates &= attacks::knight(info.to);
+                break;
+            case PieceType::BISHOP:
+                candidates &= attacks::bishop(info.to, board.occ());
+                break;
+            case PieceType::ROOK:
+                candidates &= attacks::rook(info.to, board.occ());
+                break;
+            case PieceType::QUEEN:
+                candidates &= attacks::queen(info.to, board.occ());
+                break;
+            case PieceType::KING:
+                candidates &= attacks::king(info.to);
+                break;
+            default:
+                return parseSan(board, san, moves);
+        }
+
+        if (info.from_file != File::NO_FILE) {
+            candidates &= Bitboard(info.from_file);
+        }
+
+        if (info.from_rank != Rank::NO_RANK) {
+            candidates &= Bitboard(info.from_rank);
+        }
+
+        // only one of them can move legally, drop those pinned to the king
+        if (candidates.count() > 1) {
+            Bitboard legal = 0ull;
+
+            while (candidates) {
+                const Square from = candidates.pop();
+
+                if (!exposesKing(board, from, info.to)) {
+                    legal |= Bitboard::fromSquare(from);
+                }
+            }
+
+            candidates = legal;
+        }
+
+        if (candidates.count() != 1) {
+            return parseSan(board, san, moves);
+        }
+
+        return Move::make<Move::NORMAL>(Square(candidates.lsb()), info.to);
+    }
+
    private:
+    /// @brief Check if moving a piece of the side to move, other than the king, from one square to
+    /// another would leave its king attacked by a slider.
+    [[nodiscard]] static bool exposesKing(const Board &board, Square from, Square to) noexcept {
+        const Color stm      = board.sideToMove();
+        const Square king_sq = board.kingSq(stm);
+        const Bitboard occ   = (board.occ() & ~Bitboard::fromSquare(from)) | Bitboard::fromSquare(to);
+        const Bitboard them  = board.us(~stm) & ~Bitboard::fromSquare(to);
+        const Bitboard queens = board.pieces(PieceType::QUEEN);
+
+        return (attacks::bishop(king_sq, occ) & (board.pieces(PieceType::BISHOP) | queens) & them) ||
+               (attacks::rook(king_sq, occ) & (board.pieces(PieceType::ROOK) | queens) & them);
+    }
+
     struct SanMoveInformation {
         File from_file = File::NO_FILE;
         Rank from_rank = Rank::NO_RANK;
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "binaryio.hpp"
+#include "scoreWDLstat.hpp"
+
+/// @brief Move counters of the positions of the opening books, to revert the changes by
+/// cutechess-cli, which writes the FENs of the starting positions with counters "0 1". A book
+/// file (.epd or .epd.gz) lists the positions with their counters. It is indexed once into a
+/// sidecar file, an array of the positions sorted by the 64-bit hash of their FEN without
+/// counters, followed by these FENs. Analyses map the sidecar, find the positions of a hash with
+/// a binary search and compare their FENs, so positions whose hashes collide are told apart. If
+/// there is no up to date sidecar, the book file is parsed into the same arrays in memory.
+namespace fixfenindex {
+
+struct Entry {
+    std::uint64_t hash     = 0;  // fnv1a of the first four fields of the FEN
+    std::uint32_t halfmove = 0;
+    std::uint32_t fullmove = 0;
+    std::uint64_t fen      = 0;  // offset of the null terminated FEN in the FENs of the index
+};
+
+static_assert(sizeof(Entry) == 24, "the sidecar stores entries of 24 bytes");
+
+/// @brief The positions of a book, sorted by hash, and their FENs
+struct Book {
+    std::vector<Entry> entries;
+    std::string fens;
+};
+
+class Index {
+   public:
+    [[nodiscard]] static std::string sidecar(const std::string &filename) {
+        return filename + ".fixidx";
+    }
+
+    /// @brief Use the sidecar of the book file if it still describes the file, otherwise parse
+    /// the book file.
+    /// @param filename
+    /// @return true if the sidecar was used
+    bool open(const std::string &filename) {
+        if (map_sidecar(filename)) {
+            return true;
+        }
+
+        book_      = read_book(filename);
+        data_      = book_.entries.data();
+        size_      = book_.entries.size();
+        fens_      = book_.fens.data();
+        fens_size_ = book_.fens.size();
+
+        return false;
+    }
+
+    /// @brief Parse the book file and store its positions in the sidecar, next to the file.
+    /// @param filename
+    /// @return number of positions, or nothing if the sidecar could not be written
+    [[nodiscard]] static std::optional<std::size_t> build(const std::string &filename) {
+        const auto book = read_book(filename);
+        const auto stat = binaryio::stat(filename).value_or(binaryio::FileStat());
+
+        const bool written = binaryio::write_atomic(sidecar(filename), [&](std::ostream &out) {
+            out.write(file_magic.data(), file_magic.size());
+            binaryio::write(out, stat.first);
+            binaryio::write(out, stat.second);
+            binaryio::write(out, std::uint64_t(book.entries.size()));
+            binaryio::write(out, std::uint64_t(book.fens.size()));
+            out.write(reinterpret_cast<const char *>(book.entries.data()),
+                      book.entries.size() * sizeof(Entry));
+            out.write(book.fens.data(), book.fens.size());
+        });
+
+        if (!written) {
+            return std::nullopt;
+        }
+
+        return book.entries.size();
+    }
+
+    /// @brief Look up the counters of a position.
+    /// @param fen the first four fields of the FEN, separated by single spaces
+    /// @return halfmove and fullmove counter
+    [[nodiscard]] std::optional<std::pair<int, int>> find(std::string_view fen) const {
+        const auto hash = fnv1a(fen);
+        auto it         = std::lower_bound(
+            data_, data_ + size_, hash, [](const Entry &e, std::uint64_t h) { return e.hash < h; });
+
+        for (; it != data_ + size_ && it->hash == hash; ++it) {
+            if (it->fen < fens_size_ && std::string_view(fens_ + it->fen) == fen) {
+                return std::make_pair(int(it->halfmove), int(it->fullmove));
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    [[nodiscard]] bool empty() const { return size_ == 0; }
+
+    [[nodiscard]] std::size_t size() const { return size_; }
+
+   private:
+    static constexpr std::string_view file_magic = "WDLFIX02";
+    static constexpr std::size_t header_size     = 40;
+
+    std::unique_ptr<MappedFile> mapped;
+    Book book_;
+    const Entry *data_     = nullptr;
+    std::size_t size_      = 0;
+    const char *fens_      = nullptr;
+    std::size_t fens_size_ = 0;
+
+    bool map_sidecar(const std::string &filename) {
+        auto file       = std::make_unique<MappedFile>(sidecar(filename), false);
+        const auto view = file->view();
+
+        if (view.size() < header_size || view.substr(0, file_magic.size()) != file_magic) {
+            return false;
+        }
+
+        binaryio::FileStat stat;
+        std::uint64_t count = 0, fens_size = 0;
+
+        std::memcpy(&stat.first, view.data() + 8, sizeof(stat.first));
+        std::memcpy(&stat.second, view.data() + 16, sizeof(stat.second));
+        std::memcpy(&count, view.data() + 24, sizeof(count));
+        std::memcpy(&fens_size, view.data() + 32, sizeof(fens_size));
+
+        // the last FEN must be terminated, so that no lookup reads past the end
+        if (binaryio::stat(filename) != stat ||
+            view.size() != header_size + count * sizeof(Entry) + fens_size ||
+            (fens_size > 0 && view.back() != '\0')) {
+            return false;
+        }
+
+        data_      = reinterpret_cast<const Entry *>(view.data() + header_size);
+        size_      = count;
+        fens_      = view.data() + header_size + count * sizeof(Entry);
+        fens_size_ = fens_size;
+        mapped     = std::move(file);
+
+        return true;
+    }
+
+    /// @brief Parse the lines "<board> <side> <castling> <ep> <halfmove> <fullmove>" of a book
+    /// file, skipping lines without a fullmove counter.
+    /// @param filename
+    /// @return positions sorted by hash and FEN, for duplicate FENs only the one with the lowest
+    /// fullmove counter
+    static Book read_book(const std::string &filename) {
+        std::vector<Entry> entries;
+        std::string fens, line, key;
+
+        const auto fen_iterator = [&](std::istream &iss) {
+            while (std::getline(iss, line)) {
+                std::array<std::string_view, 6> fields;
+                std::size_t n         = 0;
+                std::string_view rest = line;
+
+                while (n < fields.size()) {
+                    const auto begin = rest.find_first_not_of(" \t\r");
+
+                    if (begin == std::string_view::npos) {
+                        break;
+                    }
+
+                    rest        = rest.substr(begin);
+                    fields[n++] = rest.substr(0, rest.find_first_of(" \t\r"));
+                    rest.remove_prefix(fields[n - 1].size());
+                }
+
+                Entry entry;
+
+                if (n < fields.size() || !parse(fields[4], entry.halfmove) ||
+                    !parse(fields[5], entry.fullmove) || entry.fullmove == 0) {
+                    continue;
+                }
+
+                key.assign(fields[0]);
+
+                for (std::size_t i = 1; i < 4; i++) {
+                    key += ' ';
+                    key += fields[i];
+                }
+
+                entry.hash = fnv1a(key);
+                entry.fen  = fens.size();
+                entries.push_back(entry);
+
+                fens += key;
+                fens += '\0';
+            }
+        };
+
+        if (ends_with(filename, ".gz")) {
+            GzipInputStream input(filename);
+            fen_iterator(input);
+        } else {
+            std::ifstream input(filename);
+            fen_iterator(input);
+        }
+
+        const auto fen = [&fens](const Entry &e) { return std::string_view(fens.data() + e.fen); };
+
+        // for duplicate FENs, prefer the one with lower full move counter, and the first one
+        // among those
+        std::stable_sort(entries.begin(), entries.end(), [&fen](const Entry &a, const Entry &b) {
+            return std::make_tuple(a.hash, fen(a), a.fullmove) <
+                   std::make_tuple(b.hash, fen(b), b.fullmove);
+        });
+
+        entries.erase(std::unique(entries.begin(), entries.end(),
+                                  [&fen](const Entry &a, const Entry &b) {
+                                      return a.hash == b.hash && fen(a) == fen(b);
+                                  }),
+                      entries.end());
+
+        // keep only the FENs of the remaining entries
+        Book book;
+
+        for (auto entry : entries) {
+            const auto position = fen(entry);
+
+            entry.fen = book.fens.size();
+            book.entries.push_back(entry);
+            book.fens.append(position.data(), position.size() + 1);
+        }
+
+        return book;
+    }
+
+    /// @brief Parse the number at the start of a field, like operator>> would.
+    static bool parse(std::string_view field, std::uint32_t &value) {
+        return std::from_chars(field.data(), field.data() + field.size(), value).ec == std::errc();
+    }
+};
+
+}  // namespace fixfenindex
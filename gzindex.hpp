@@ -0,0 +1,516 @@
+#pragma once
+
+#include <sys/types.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "binaryio.hpp"
+
+/// @brief Random access into .pgn.gz files, following zlib's examples/zran.c. While a file is
+/// inflated from the start, an access point is recorded at the first deflate block boundary after
+/// every span bytes of uncompressed data. An access point stores the position in the compressed
+/// file, including the bit offset, and the 32 KiB window needed to resume inflating from there.
+/// It also stores the offset of the first game starting after it, such that the ranges between
+/// two access points can be analysed independently.
+namespace gzindex {
+
+static constexpr std::size_t window_size = 32768;
+
+struct AccessPoint {
+    std::uint64_t out  = 0;  // offset in the uncompressed data
+    std::uint64_t in   = 0;  // offset of the first complete byte in the compressed file
+    std::uint64_t game = 0;  // offset in the uncompressed data of the next game start
+    int bits           = 0;  // number of bits of the byte at in - 1 that belong to the block
+    std::vector<unsigned char> window;
+};
+
+class Index {
+   public:
+    std::uint64_t span            = 0;
+    std::uint64_t compressed_size = 0;
+    std::int64_t mtime            = 0;
+    std::uint64_t total_out       = 0;
+    std::vector<AccessPoint> points;
+
+    [[nodiscard]] static std::string sidecar(const std::string &filename) {
+        return filename + ".gzidx";
+    }
+
+    /// @brief Load the sidecar index of a file, if it exists and still describes the file.
+    /// @param filename
+    /// @param span
+    /// @return
+    [[nodiscard]] static std::optional<Index> load(const std::string &filename,
+                                                   std::uint64_t span) {
+        std::ifstream in(sidecar(filename), std::ios::binary);
+
+        if (!in) {
+            return std::nullopt;
+        }
+
+        Index index;
+        std::uint64_t count = 0;
+
+        const bool magic = binaryio::read_magic(in, file_magic);
+        binaryio::read(in, index.span);
+        binaryio::read(in, index.compressed_size);
+        binaryio::read(in, index.mtime);
+        binaryio::read(in, index.total_out);
+        binaryio::read(in, count);
+
+        if (!in || !magic || index.span != span || !index.describes(filename)) {
+            return std::nullopt;
+        }
+
+        index.points.resize(count);
+
+        for (auto &point : index.points) {
+            std::uint64_t window_length = 0;
+            std::int64_t bits           = 0;
+
+            binaryio::read(in, point.out);
+            binaryio::read(in, point.in);
+            binaryio::read(in, point.game);
+            binaryio::read(in, bits);
+            binaryio::read(in, window_length);
+
+            if (!in || window_length > window_size) {
+                return std::nullopt;
+            }
+
+            point.bits = bits;
+            point.window.resize(window_length);
+            in.read(reinterpret_cast<char *>(point.window.data()), window_length);
+        }
+
+        if (!in) {
+            return std::nullopt;
+        }
+
+        return index;
+    }
+
+    /// @brief Write the sidecar index.
+    /// @param filename
+    /// @return
+    bool save(const std::string &filename) const {
+        return binaryio::write_atomic(sidecar(filename), [this](std::ostream &out) {
+            out.write(file_magic.data(), file_magic.size());
+            binaryio::write(out, span);
+            binaryio::write(out, compressed_size);
+            binaryio::write(out, mtime);
+            binaryio::write(out, total_out);
+            binaryio::write(out, std::uint64_t(points.size()));
+
+            for (const auto &point : points) {
+                binaryio::write(out, point.out);
+                binaryio::write(out, point.in);
+                binaryio::write(out, point.game);
+                binaryio::write(out, std::int64_t(point.bits));
+                binaryio::write(out, std::uint64_t(point.window.size()));
+                out.write(reinterpret_cast<const char *>(point.window.data()),
+                          point.window.size());
+            }
+        });
+    }
+
+    /// @brief Check that size and modification time of the file match the index.
+    /// @param filename
+    /// @return
+    bool describes(const std::string &filename) const {
+        return binaryio::stat(filename) == binaryio::FileStat(compressed_size, mtime);
+    }
+
+   private:
+    static constexpr std::string_view file_magic = "WDLGZIX1";
+};
+
+/// @brief Inflates a gzip file, either from its start, optionally recording access points, or
+/// from an access point of its index.
+class Reader {
+   public:
+    Reader() = default;
+
+    Reader(const Reader &)            = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    ~Reader() {
+        if (initialized) {
+            inflateEnd(&strm);
+        }
+
+        if (file != nullptr) {
+            std::fclose(file);
+        }
+    }
+
+    /// @brief Inflate from the start of the file, recording access points every span bytes, if
+    /// span is not zero.
+    /// @param filename
+    /// @param span
+    /// @return
+    bool open(const std::string &filename, std::uint64_t span = 0) {
+        this->span = span;
+
+        // 47: automatic zlib or gzip header detection, maximum window size
+        return open_file(filename, 0) && init(47);
+    }
+
+    /// @brief Inflate from an access point of the file's index.
+    /// @param filename
+    /// @param point
+    /// @return
+    bool open(const std::string &filename, const AccessPoint &point) {
+        if (point.out == 0) {
+            return open(filename);
+        }
+
+        if (!open_file(filename, point.in - (point.bits ? 1 : 0)) || !init(-15)) {
+            return false;
+        }
+
+        if (point.bits) {
+            const int c = std::fgetc(file);
+
+            if (c == EOF || inflatePrime(&strm, point.bits, c >> (8 - point.bits)) != Z_OK) {
+                return fail();
+            }
+        }
+
+        if (inflateSetDictionary(&strm, point.window.data(), point.window.size()) != Z_OK) {
+            return fail();
+        }
+
+        total_out = point.out;
+
+        return true;
+    }
+
+    /// @brief Inflate up to n bytes into dst.
+    /// @param dst
+    /// @param n
+    /// @return number of bytes inflated, 0 at the end of the data or on errors
+    std::size_t read(char *dst, std::size_t n) {
+        std::size_t produced = 0;
+
+        while (produced < n && !finished) {
+            if (strm.avail_in == 0) {
+                const auto got = std::fread(input.get(), 1, input_size, file);
+
+                if (got == 0) {
+                    // the deflate stream must not end before its end marker
+                    if (!stream_end) fail();
+
+                    finished = true;
+                    break;
+                }
+
+                strm.next_in  = input.get();
+                strm.avail_in = got;
+            }
+
+            if (stream_end) {
+                // gzip files may consist of several members, those are not indexed
+                multi_member = true;
+                stream_end   = false;
+                inflateReset(&strm);
+            }
+
+            const auto avail_in  = strm.avail_in;
+            const auto avail_out = static_cast<uInt>(std::min<std::size_t>(n - produced, UINT_MAX));
+
+            strm.next_out  = reinterpret_cast<Bytef *>(dst + produced);
+            strm.avail_out = avail_out;
+
+            const int ret = inflate(&strm, span ? Z_BLOCK : Z_NO_FLUSH);
+
+            total_in += avail_in - strm.avail_in;
+            total_out += avail_out - strm.avail_out;
+            produced += avail_out - strm.avail_out;
+
+            if (ret == Z_STREAM_END) {
+                stream_end = true;
+
+                // a raw deflate stream, started from an access point, ends here
+                if (raw) finished = true;
+
+                continue;
+            }
+
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                fail();
+                break;
+            }
+
+            if (span && (strm.data_type & 128) && !(strm.data_type & 64) &&
+                total_out - last_point >= span) {
+                add_point();
+            }
+        }
+
+        if (span && !points.empty()) {
+            scan_games(dst, produced);
+        }
+
+        return produced;
+    }
+
+    /// @brief The index recorded while inflating the complete file, if any.
+    /// @param filename
+    /// @return
+    [[nodiscard]] std::optional<Index> index(const std::string &filename) const {
+        if (!span || !finished || failed || multi_member) {
+            return std::nullopt;
+        }
+
+        const auto stat = binaryio::stat(filename);
+
+        if (!stat) {
+            return std::nullopt;
+        }
+
+        Index index;
+
+        index.span            = span;
+        index.compressed_size = stat->first;
+        index.mtime           = stat->second;
+        index.total_out       = total_out;
+
+        // the start of the file is an implicit access point, at the start of the first game
+        index.points.push_back(AccessPoint{});
+
+        for (const auto &point : points) {
+            // drop access points without a game start before the next one
+            if (point.game < total_out && point.game > index.points.back().game) {
+                index.points.push_back(point);
+            }
+        }
+
+        return index;
+    }
+
+   private:
+    bool open_file(const std::string &filename, std::uint64_t offset) {
+        file = std::fopen(filename.c_str(), "rb");
+
+        if (file == nullptr) {
+            return false;
+        }
+
+        input = std::make_unique<unsigned char[]>(input_size);
+
+        return seek(file, offset);
+    }
+
+    /// @brief Seek to an offset of the file. std::fseek takes a long, which has 32 bits on
+    /// Windows, so the 64-bit variants are used as in zran.
+    /// @param file
+    /// @param offset
+    /// @return
+    static bool seek(std::FILE *file, std::uint64_t offset) {
+#ifdef _WIN32
+        return offset <= std::uint64_t(std::numeric_limits<__int64>::max()) &&
+               _fseeki64(file, __int64(offset), SEEK_SET) == 0;
+#else
+        return offset <= std::uint64_t(std::numeric_limits<off_t>::max()) &&
+               fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+    }
+
+    bool init(int window_bits) {
+        strm          = z_stream{};
+        raw           = window_bits < 0;
+        initialized   = inflateInit2(&strm, window_bits) == Z_OK;
+        strm.next_in  = input.get();
+        strm.avail_in = 0;
+
+        return initialized || fail();
+    }
+
+    bool fail() {
+        failed   = true;
+        finished = true;
+
+        return false;
+    }
+
+    void add_point() {
+        AccessPoint point;
+        uInt length = window_size;
+
+        point.out  = total_out;
+        point.in   = total_in;
+        point.bits = strm.data_type & 7;
+        point.game = UINT64_MAX;
+        point.window.resize(window_size);
+
+        if (inflateGetDictionary(&strm, point.window.data(), &length) != Z_OK) {
+            return;
+        }
+
+        point.window.resize(length);
+        points.push_back(std::move(point));
+        last_point = total_out;
+    }
+
+    /// @brief Find for pending access points the first game start, i.e. an [Event tag after an
+    /// empty line, in the just inflated data that ends at total_out.
+    /// @param data
+    /// @param n
+    void scan_games(const char *data, std::size_t n) {
+        if (unresolved < points.size()) {
+            const std::uint64_t base = total_out - n - tail.size();
+
+            std::string buffer = tail;
+            buffer.append(data, n);
+
+            for (; unresolved < points.size(); unresolved++) {
+                auto &point     = points[unresolved];
+                std::size_t pos = point.out > base + 1 ? point.out - base - 1 : 0;
+
+                while ((pos = buffer.find("\n[Event ", pos)) != std::string::npos) {
+                    if (pos >= 2 && (buffer[pos - 1] == '\n' ||
+                                     (buffer[pos - 1] == '\r' && buffer[pos - 2] == '\n'))) {
+                        break;
+                    }
+
+                    pos++;
+                }
+
+                if (pos == std::string::npos) {
+                    break;
+                }
+
+                point.game = base + pos + 1;
+            }
+        }
+
+        // keep enough of the data to find game starts that cross the boundary
+        tail.append(data, n);
+
+        if (tail.size() > tail_size) {
+            tail.erase(0, tail.size() - tail_size);
+        }
+    }
+
+    static constexpr std::size_t input_size = 256 * 1024;
+    static constexpr std::size_t tail_size  = 16;
+
+    std::FILE *file = nullptr;
+    std::unique_ptr<unsigned char[]> input;
+    z_stream strm     = {};
+    bool initialized  = false;
+    bool raw          = false;
+    bool stream_end   = false;
+    bool finished     = false;
+    bool failed       = false;
+    bool multi_member = false;
+
+    std::uint64_t total_in  = 0;
+    std::uint64_t total_out = 0;
+
+    std::uint64_t span       = 0;
+    std::uint64_t last_point = 0;
+    std::size_t unresolved   = 0;
+    std::vector<AccessPoint> points;
+    std::string tail;
+};
+
+/// @brief Read-only streambuf on top of Reader, optionally limited to the range of games that
+/// starts after the access point first and ends with the access point last.
+class InputBuffer : public std::streambuf {
+   public:
+    /// @brief Inflate the complete file, recording access points every span bytes.
+    InputBuffer(const std::string &filename, std::uint64_t span) {
+        reader.open(filename, span);
+    }
+
+    /// @brief Inflate the games between two access points, last may be nullptr for the end.
+    InputBuffer(const std::string &filename, const AccessPoint &first, const AccessPoint *last) {
+        if (!reader.open(filename, first)) {
+            return;
+        }
+
+        remaining = last != nullptr ? last->game - first.game : UINT64_MAX;
+
+        // skip to the start of the first game after the access point
+        for (std::uint64_t skip = first.game - first.out; skip > 0;) {
+            const auto n = reader.read(buffer.data(), std::min<std::uint64_t>(skip, buffer.size()));
+
+            if (n == 0) {
+                remaining = 0;
+                break;
+            }
+
+            skip -= n;
+        }
+    }
+
+    Reader reader;
+
+   protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        const auto n = read(buffer.data(), buffer.size());
+
+        if (n == 0) {
+            return traits_type::eof();
+        }
+
+        setg(buffer.data(), buffer.data(), buffer.data() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char *s, std::streamsize count) override {
+        // first hand out what is left from previous single character reads
+        std::streamsize done = std::min<std::streamsize>(egptr() - gptr(), count);
+        std::memcpy(s, gptr(), done);
+        gbump(done);
+
+        return done + read(s + done, count - done);
+    }
+
+   private:
+    std::size_t read(char *dst, std::size_t n) {
+        const auto got = reader.read(dst, std::min<std::uint64_t>(n, remaining));
+        remaining -= got;
+
+        return got;
+    }
+
+    std::uint64_t remaining = UINT64_MAX;
+    std::array<char, 4096> buffer;
+};
+
+/// @brief std::istream reading through InputBuffer.
+class InputStream : public std::istream {
+   public:
+    template <typename... Args>
+    explicit InputStream(const std::string &filename, Args &&...args)
+        : std::istream(nullptr), buf(filename, std::forward<Args>(args)...) {
+        rdbuf(&buf);
+    }
+
+    InputBuffer buf;
+};
+
+}  // namespace gzindex
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "binaryio.hpp"
+#include "scoreWDLstat.hpp"
+
+/// @brief Persistent index of the metadata of all tests seen so far, such that runs over a large
+/// archive only parse the jsons of new or modified tests. A row holds the TestMetaData of a test
+/// together with the size and modification time of its json, and is only used while these still
+/// match the json on disk.
+namespace metaindex {
+
+struct Row {
+    std::uint64_t size = 0;
+    std::int64_t mtime = 0;
+    TestMetaData meta;
+};
+
+class Index {
+   public:
+    /// @brief Load the index from a file, an unreadable or outdated file gives an empty index.
+    /// @param filename
+    explicit Index(const std::string &filename) : filename(filename) {
+        std::ifstream in(filename, std::ios::binary);
+
+        if (!in) {
+            return;
+        }
+
+        std::uint64_t count = 0;
+
+        const bool magic = binaryio::read_magic(in, file_magic);
+        binaryio::read(in, count);
+
+        if (!in || !magic) {
+            return;
+        }
+
+        for (std::uint64_t i = 0; i < count && in; i++) {
+            std::string test;
+            Row row;
+
+            binaryio::read_string(in, test, max_length);
+            binaryio::read(in, row.size);
+            binaryio::read(in, row.mtime);
+            read_meta(in, row.meta);
+
+            if (in) {
+                rows.emplace(std::move(test), std::move(row));
+            }
+        }
+
+        if (!in) {
+            rows.clear();
+        }
+    }
+
+    /// @brief The metadata of a test, if its json did not change since it was indexed.
+    /// @param test path of the test without extension
+    /// @param stat size and modification time of the test's json
+    /// @return
+    [[nodiscard]] const TestMetaData *find(const std::string &test,
+                                           const binaryio::FileStat &stat) const {
+        const auto it = rows.find(test);
+
+        if (it == rows.end() || it->second.size != stat.first || it->second.mtime != stat.second) {
+            return nullptr;
+        }
+
+        return &it->second.meta;
+    }
+
+    void insert(const std::string &test, const binaryio::FileStat &stat, TestMetaData meta) {
+        rows[test] = Row{stat.first, stat.second, std::move(meta)};
+        changed    = true;
+    }
+
+    void erase(const std::string &test) { changed = rows.erase(test) > 0 || changed; }
+
+    /// @brief Write the index back to its file, if anything changed.
+    /// @return
+    bool save() const {
+        if (!changed) {
+            return true;
+        }
+
+        return binaryio::write_atomic(filename, [this](std::ostream &out) {
+            out.write(file_magic.data(), file_magic.size());
+            binaryio::write(out, std::uint64_t(rows.size()));
+
+            for (const auto &[test, row] : rows) {
+                binaryio::write_string(out, test);
+                binaryio::write(out, row.size);
+                binaryio::write(out, row.mtime);
+                write_meta(out, row.meta);
+            }
+        });
+    }
+
+    std::size_t size() const { return rows.size(); }
+
+   private:
+    static constexpr std::string_view file_magic = "WDLMETA1";
+    // longer strings or lists only appear in a corrupt index
+    static constexpr std::uint32_t max_length = 1 << 16;
+
+    std::string filename;
+    std::unordered_map<std::string, Row> rows;
+    bool changed = false;
+
+    // bits of the fields present in a row
+    enum Field : std::uint8_t {
+        BOOK          = 1 << 0,
+        NEW_TC        = 1 << 1,
+        RESOLVED_BASE = 1 << 2,
+        RESOLVED_NEW  = 1 << 3,
+        TC            = 1 << 4,
+        THREADS       = 1 << 5,
+        SPRT          = 1 << 6,
+        PENTANOMIAL   = 1 << 7,
+    };
+
+    static void write_meta(std::ostream &out, const TestMetaData &meta) {
+        const std::uint8_t fields =
+            (meta.book ? BOOK : 0) | (meta.new_tc ? NEW_TC : 0) |
+            (meta.resolved_base ? RESOLVED_BASE : 0) | (meta.resolved_new ? RESOLVED_NEW : 0) |
+            (meta.tc ? TC : 0) | (meta.threads ? THREADS : 0) | (meta.sprt ? SPRT : 0) |
+            (meta.pentanomial ? PENTANOMIAL : 0);
+
+        binaryio::write(out, fields);
+
+        for (const auto *str : {&meta.book, &meta.new_tc, &meta.resolved_base, &meta.resolved_new,
+                                &meta.tc}) {
+            if (*str) {
+                binaryio::write_string(out, **str);
+            }
+        }
+
+        if (meta.threads) {
+            binaryio::write(out, std::int32_t(*meta.threads));
+        }
+
+        if (meta.sprt) {
+            binaryio::write(out, std::uint8_t(*meta.sprt));
+        }
+
+        if (meta.pentanomial) {
+            binaryio::write(out, std::uint32_t(meta.pentanomial->size()));
+
+            for (const auto value : *meta.pentanomial) {
+                binaryio::write(out, std::int32_t(value));
+            }
+        }
+    }
+
+    static void read_meta(std::istream &in, TestMetaData &meta) {
+        std::uint8_t fields = 0;
+        binaryio::read(in, fields);
+
+        for (auto [field, str] : {std::make_pair(BOOK, &meta.book),
+                                  std::make_pair(NEW_TC, &meta.new_tc),
+                                  std::make_pair(RESOLVED_BASE, &meta.resolved_base),
+                                  std::make_pair(RESOLVED_NEW, &meta.resolved_new),
+                                  std::make_pair(TC, &meta.tc)}) {
+            if (fields & field) {
+                binaryio::read_string(in, str->emplace(), max_length);
+            }
+        }
+
+        if (fields & THREADS) {
+            std::int32_t threads = 0;
+            binaryio::read(in, threads);
+            meta.threads = threads;
+        }
+
+        if (fields & SPRT) {
+            std::uint8_t sprt = 0;
+            binaryio::read(in, sprt);
+            meta.sprt = sprt != 0;
+        }
+
+        if (fields & PENTANOMIAL) {
+            std::uint32_t count = 0;
+            binaryio::read(in, count);
+
+            auto &pentanomial = meta.pentanomial.emplace();
+
+            if (count > max_length) {
+                in.setstate(std::ios::failbit);
+            }
+
+            for (std::uint32_t i = 0; i < count && in; i++) {
+                std::int32_t value = 0;
+                binaryio::read(in, value);
+                pentanomial.push_back(value);
+            }
+        }
+    }
+};
+
+}  // namespace metaindex
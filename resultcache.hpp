@@ -0,0 +1,215 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "binaryio.hpp"
+#include "scoreWDLstat.hpp"
+
+/// @brief Cache of the positions counted in single pgn files, or parts of them, such that reruns
+/// over a growing collection of pgns only need to analyse the new files. Every entry is a file of
+/// its own in the cache directory, named after the hash of the pgn file's path, the part of the
+/// file and the analysis options. An entry is only used if the size and modification time of the
+/// pgn file are still the ones recorded in it. Entries of other options are removed by prune().
+namespace resultcache {
+
+/// @brief The positions counted in (part of) a file, sorted by key, and the number of games
+struct Entry {
+    std::uint64_t games = 0;
+    std::vector<std::pair<PackedKey, int>> records;
+    // verdicts of the engine filter for the engines of the games, which decided what is counted
+    std::vector<std::pair<std::string, bool>> engines;
+};
+
+class Cache {
+   public:
+    /// @brief
+    /// @param directory where the entries are stored, created if it does not exist
+    /// @param options_hash hash of all options that change the counted positions
+    Cache(const std::string &directory, std::uint64_t options_hash)
+        : directory(directory), options_hash(options_hash) {
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+    }
+
+    /// @brief Load the entry for a part of a file, if it exists and the file did not change.
+    /// @param filename
+    /// @param part describes the part of the file, empty for the whole file
+    /// @return
+    [[nodiscard]] std::optional<Entry> load(const std::string &filename,
+                                            const std::string &part) const {
+        std::ifstream in(path(filename, part), std::ios::binary);
+
+        if (!in) {
+            return std::nullopt;
+        }
+
+        const auto stat = binaryio::stat(filename);
+        const auto name = entry_name(filename, part);
+
+        std::uint64_t hash = 0, name_length = 0, count = 0;
+        binaryio::FileStat entry_stat;
+        Entry entry;
+
+        const bool magic = binaryio::read_magic(in, file_magic);
+        binaryio::read(in, hash);
+        binaryio::read(in, entry_stat.first);
+        binaryio::read(in, entry_stat.second);
+        binaryio::read(in, name_length);
+
+        if (!in || !magic || hash != options_hash || stat != entry_stat ||
+            name_length != name.size()) {
+            return std::nullopt;
+        }
+
+        std::string stored_name(name_length, '\0');
+        in.read(stored_name.data(), name_length);
+        binaryio::read(in, entry.games);
+        binaryio::read(in, count);
+
+        if (!in || stored_name != name) {
+            return std::nullopt;
+        }
+
+        entry.records.resize(count);
+
+        for (auto &record : entry.records) {
+            binaryio::read(in, record.first.value);
+            binaryio::read(in, record.second);
+        }
+
+        binaryio::read(in, count);
+
+        if (count > max_length) {
+            in.setstate(std::ios::failbit);
+        }
+
+        for (std::uint64_t i = 0; i < count && in; i++) {
+            auto &[engine, verdict] = entry.engines.emplace_back();
+            std::uint8_t match      = 0;
+
+            binaryio::read_string(in, engine, max_length);
+            binaryio::read(in, match);
+            verdict = match != 0;
+        }
+
+        if (!in) {
+            return std::nullopt;
+        }
+
+        return entry;
+    }
+
+    /// @brief Store the entry for a part of a file. Nothing is stored if the file changed while it
+    /// was analysed.
+    /// @param filename
+    /// @param part
+    /// @param entry
+    /// @param analysed stat of the file before it was analysed
+    /// @return
+    bool store(const std::string &filename, const std::string &part, const Entry &entry,
+               const std::optional<binaryio::FileStat> &analysed) const {
+        // the counts of a file that could not be stat'ed, or changed since, have no valid entry
+        if (!analysed || binaryio::stat(filename) != analysed) {
+            return false;
+        }
+
+        const auto name = entry_name(filename, part);
+
+        return binaryio::write_atomic(path(filename, part), [&](std::ostream &out) {
+            out.write(file_magic.data(), file_magic.size());
+            binaryio::write(out, options_hash);
+            binaryio::write(out, analysed->first);
+            binaryio::write(out, analysed->second);
+            binaryio::write(out, std::uint64_t(name.size()));
+            out.write(name.data(), name.size());
+            binaryio::write(out, entry.games);
+            binaryio::write(out, std::uint64_t(entry.records.size()));
+
+            for (const auto &record : entry.records) {
+                binaryio::write(out, record.first.value);
+                binaryio::write(out, record.second);
+            }
+
+            binaryio::write(out, std::uint64_t(entry.engines.size()));
+
+            for (const auto &[engine, verdict] : entry.engines) {
+                binaryio::write_string(out, engine);
+                binaryio::write(out, std::uint8_t(verdict));
+            }
+        });
+    }
+
+    /// @brief Remove the entries of other options, or of an older format, which runs with these
+    /// options never read, such that the cache does not grow with every change of options.
+    /// @return number of removed entries
+    std::size_t prune() const {
+        std::vector<std::filesystem::path> stale;
+        std::error_code ec;
+
+        for (std::filesystem::directory_iterator it(directory, ec), end; !ec && it != end;
+             it.increment(ec)) {
+            if (it->path().extension() != ".wdlpart") {
+                continue;
+            }
+
+            std::ifstream in(it->path(), std::ios::binary);
+            std::uint64_t hash = 0;
+
+            const bool magic = binaryio::read_magic(in, file_magic);
+            binaryio::read(in, hash);
+
+            if (!in || !magic || hash != options_hash) {
+                stale.push_back(it->path());
+            }
+        }
+
+        std::size_t removed = 0;
+
+        for (const auto &path : stale) {
+            removed += std::filesystem::remove(path, ec);
+        }
+
+        return removed;
+    }
+
+    /// @brief Count an entry as used.
+    void hit() const { hits++; }
+
+    /// @brief Number of entries used so far
+    std::size_t loaded() const { return hits; }
+
+   private:
+    static constexpr std::string_view file_magic = "WDLCACH2";
+    // longer engine names or lists only appear in a corrupt entry
+    static constexpr std::uint32_t max_length = 1 << 16;
+
+    std::string directory;
+    std::uint64_t options_hash;
+    mutable std::atomic<std::size_t> hits = 0;
+
+    static std::string entry_name(const std::string &filename, const std::string &part) {
+        return filename + '\0' + part;
+    }
+
+    std::string path(const std::string &filename, const std::string &part) const {
+        std::string name = entry_name(filename, part);
+        name.append(reinterpret_cast<const char *>(&options_hash), sizeof(options_hash));
+
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(fnv1a(name)));
+
+        return (std::filesystem::path(directory) / (std::string(hex) + ".wdlpart")).string();
+    }
+};
+
+}  // namespace resultcache
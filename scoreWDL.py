@@ -1,4 +1,4 @@
-import argparse, json, matplotlib.pyplot as plt, numpy as np, time
+import argparse, gzip, json, matplotlib.pyplot as plt, numpy as np, os, time
 from ast import literal_eval
 from scipy.interpolate import griddata
 from scipy.optimize import curve_fit, minimize
@@ -96,12 +96,91 @@ class WdlData:
         elif result == "L":
             self.losses[mom_idx, eval_idx] += value
 
+    def load_binary_data(self, filename):
+        """load the WDL data from a .wdlbin file written by scoreWDLstat: a 56 byte header
+        followed by sorted (key, count) records, with the key packing (result, move, material, eval)
+        as described by the layout in the header"""
+        header_dtype = np.dtype(
+            [
+                ("magic", "S8"),
+                ("header_size", "<u4"),
+                ("bin_width", "<u4"),
+                ("records", "<u8"),
+                ("positions", "<u8"),
+                ("games", "<u8"),
+                (
+                    "layout",
+                    [("shift", "u1"), ("bits", "u1"), ("offset", "<i2")],
+                    (4,),
+                ),
+            ]
+        )
+        header = np.fromfile(filename, dtype=header_dtype, count=1)[0]
+        assert header["magic"] == b"WDLBIN01", f"Error: {filename} is not a .wdlbin file."
+        header_size, n_records = int(header["header_size"]), int(header["records"])
+        assert (
+            header_size >= header_dtype.itemsize
+            and header_size + 8 * n_records == os.path.getsize(filename)
+        ), f"Error: The size of {filename} does not match its header."
+
+        records = np.memmap(
+            filename,
+            dtype=[("key", "<u4"), ("count", "<u4")],
+            mode="r",
+            offset=header_size,
+            shape=(n_records,),
+        )
+        print(
+            f"Found {header['positions']} positions from {header['games']} games, binWidth = {header['bin_width']}."
+        )
+
+        key = records["key"].astype(np.int64)
+        result, move, material, eval = (
+            ((key >> int(f["shift"])) & ((1 << int(f["bits"])) - 1)) + int(f["offset"])
+            for f in header["layout"]
+        )
+        count = records["count"].astype(int)
+
+        keep = (move >= self.moveMin) & (move <= self.moveMax)
+        keep &= (material >= self.materialMin) & (material <= self.materialMax)
+        result, move, material, eval, count = (
+            a[keep] for a in (result, move, material, eval, count)
+        )
+
+        # convert the cp eval to the internal value by undoing the normalization
+        if self.NormalizeData is None:
+            a_internal = self.normalize_to_pawn_value
+        else:
+            mom = move if self.NormalizeData["momType"] == "move" else material
+            mom_clamped = np.clip(
+                mom, self.NormalizeData["momMin"], self.NormalizeData["momMax"]
+            )
+            a_internal = poly3(
+                mom_clamped / self.NormalizeData["momTarget"], *self.NormalizeData["as"]
+            )
+        eval_internal = np.round(eval * a_internal / 100).astype(int)
+
+        keep = np.abs(eval_internal) <= self.eval_max
+        mom = (move if self.momType == "move" else material)[keep]
+        mom_idx, eval_idx = mom - self.offset_mom, eval_internal[keep] - self.offset_eval
+        result, count = result[keep], count[keep]
+
+        # result codes 0, 1, 2 stand for D, L, W
+        for code, counter in enumerate([self.draws, self.losses, self.wins]):
+            selected = result == code
+            np.add.at(counter, (mom_idx[selected], eval_idx[selected]), count[selected])
+
     def load_json_data(self, filenames):
         """load the WDL data from json: the keys describe the position (result, move, material, eval),
         and the values are the observed count of these positions"""
         for filename in filenames:
             print(f"Reading eval stats from {filename}.")
-            with open(filename) as infile:
+            if filename.endswith(".wdlbin"):
+                self.load_binary_data(filename)
+                continue
+            with (
+                gzip.open(filename, "rt") if filename.endswith(".gz") else open(filename)
+            ) as infile:
                 data = json.load(infile)
 
                 for key, value in data.items() if data else []:
@@ -609,7 +688,7 @@ if __name__ == "__main__":
     parser.add_argument(
         "filename",
         nargs="*",
-        help="json file(s) with fishtest games' win/draw/loss statistics",
+        help="json(.gz) or .wdlbin file(s) with fishtest games' win/draw/loss statistics",
         default=["scoreWDLstat.json"],
     )
     parser.add_argument(
@@ -1,82 +1,269 @@
 #include "scoreWDLstat.hpp"
 
+#include <array>
 #include <atomic>
+#include <charconv>
 #include <chrono>
 #include <cmath>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <numeric>
+#include <random>
 #include <regex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "binaryio.hpp"
+#include "crawler.hpp"
 #include "external/chess.hpp"
 #include "external/gzip/gzstream.h"
 #include "external/parallel_hashmap/phmap.h"
 #include "external/threadpool.hpp"
+#include "fixfenindex.hpp"
+#include "gzindex.hpp"
+#include "metaindex.hpp"
+#include "resultcache.hpp"
 
 namespace fs = std::filesystem;
 using json   = nlohmann::json;
 
 using namespace chess;
 
-// unordered map to count (result, move, material, eval) tuples in pgns
-using map_t =
-    phmap::parallel_flat_hash_map<Key, int, std::hash<Key>, std::equal_to<Key>,
-                                  std::allocator<std::pair<const Key, int>>, 8, std::mutex>;
+// unordered map to count (result, move, material, eval) tuples in pgns, with 8 byte slots
+using map_t = phmap::parallel_flat_hash_map<PackedKey, int, std::hash<PackedKey>,
+                                            std::equal_to<PackedKey>,
+                                            std::allocator<std::pair<const PackedKey, int>>, 8,
+                                            std::mutex>;
+
+// unordered map to count (result, move, material, eval) tuples in a single thread
+using map_local_t =
+    phmap::flat_hash_map<PackedKey, int, std::hash<PackedKey>, std::equal_to<PackedKey>>;
 
 // map to collect metadata for tests
 using map_meta = std::unordered_map<std::string, TestMetaData>;
 
-// map to hold move counters that cutechess-cli changed from original FENs
-using map_fens = std::unordered_map<std::string, std::pair<int, int>>;
-
 // concurrent position map
 map_t pos_map                         = {};
 std::atomic<std::size_t> total_chunks = 0;
 std::atomic<std::size_t> total_games  = 0;
 
+// positions with keys that do not fit into a PackedKey, by (result, move, material, eval), which
+// only a corrupt input or an unchecked option produces
+std::map<std::tuple<char, int, int, int>, int> unpacked_map;
+std::atomic<std::size_t> total_unpacked = 0;
+std::mutex unpacked_mutex;
+
+/// @brief Count a position whose key does not fit into a PackedKey.
+/// @param key
+/// @param count
+void count_unpacked(const Key &key, int count) {
+    const std::lock_guard<std::mutex> lock(unpacked_mutex);
+
+    unpacked_map[{char(key.result), key.move, key.material, key.eval}] += count;
+    total_unpacked += count;
+}
+
+// per thread position maps and dense counters, merged into pos_map at the end of process()
+std::vector<std::unique_ptr<map_local_t>> local_maps;
+std::vector<std::unique_ptr<DenseCounts>> local_dense;
+std::mutex local_maps_mutex;
+
 namespace analysis {
 
 /// @brief Magic value for fishtest pgns, ~1.2 million keys
 static constexpr int map_size = 1200000;
 
+/// @brief Default size of the blocks in which pgn files are read and inflated, in MiB
+static constexpr int default_block_size = 4;
+
+/// @brief Where positions are counted: directly in the shared pos_map, in a map per thread, or
+/// in dense counters per thread (with a map per thread for keys outside of their domain)
+enum class Aggregation { SHARED, LOCAL, DENSE };
+
+/// @brief Settings for reading and analysing pgn files
+struct Options {
+    std::string regex_engine;
+    RevisionSet engine_revs;
+    fixfenindex::Index fixfen;
+    std::string fixfen_source;
+    std::string cache_dir;
+    int bin_width           = 5;
+    int move_max            = DenseCounts::max_move;
+    std::size_t block_size  = std::size_t(default_block_size) << 20;
+    std::size_t split_size  = 0;
+    std::size_t index_span  = 0;
+    Aggregation aggregation = Aggregation::LOCAL;
+    bool verify_san         = false;
+};
+
+/// @brief Hash of the options that change the positions counted in a file, to tell apart cache
+/// entries of different analyses. Of the engine filter only its presence is part of the hash,
+/// which revisions or regex it matches is checked per entry, see ana_cached().
+/// @param options
+/// @return
+std::uint64_t options_hash(const Options &options) {
+    const bool engine_filter = !options.engine_revs.empty() || !options.regex_engine.empty();
+
+    std::string description = "v2\nbinWidth=" + std::to_string(options.bin_width) +
+                              "\nmoveMax=" + std::to_string(options.move_max) +
+                              "\nengineFilter=" + std::to_string(engine_filter) +
+                              "\nfixFENsource=";
+
+    if (!options.fixfen_source.empty()) {
+        std::error_code ec;
+        const auto size  = fs::file_size(options.fixfen_source, ec);
+        const auto mtime = fs::last_write_time(options.fixfen_source, ec);
+
+        description += fs::absolute(options.fixfen_source).string() + ':' + std::to_string(size) +
+                       ':' + std::to_string(mtime.time_since_epoch().count());
+    }
+
+    return fnv1a(description);
+}
+
+/// @brief The position map of the calling thread, created on first use
+/// @return
+map_local_t &local_pos_map() {
+    thread_local map_local_t *local_map = nullptr;
+
+    if (local_map == nullptr) {
+        const std::lock_guard<std::mutex> lock(local_maps_mutex);
+
+        local_maps.push_back(std::make_unique<map_local_t>());
+        local_map = local_maps.back().get();
+    }
+
+    return *local_map;
+}
+
+/// @brief The dense counters of the calling thread, created on first use
+/// @param bin_width
+/// @return
+DenseCounts &local_dense_counts(int bin_width) {
+    thread_local DenseCounts *dense = nullptr;
+
+    if (dense == nullptr) {
+        auto counts = std::make_unique<DenseCounts>(bin_width);
+
+        const std::lock_guard<std::mutex> lock(local_maps_mutex);
+
+        local_dense.push_back(std::move(counts));
+        dense = local_dense.back().get();
+    }
+
+    return *dense;
+}
+
+/// @brief Filter on the engine names in the pgns, by a regex or a set of revision SHAs. The regex
+/// is compiled once, and the verdict for each distinct name is remembered, such that filtering
+/// a game usually costs two hash lookups.
+class EngineFilter {
+   public:
+    explicit EngineFilter(const Options &options)
+        : pattern(options.regex_engine), revs(options.engine_revs) {
+        if (revs.empty() && !pattern.empty()) {
+            regex.emplace(pattern);
+        }
+    }
+
+    /// @brief Check if the filter was built for the given options.
+    /// @param options
+    /// @return
+    bool uses(const Options &options) const {
+        return &revs == &options.engine_revs && pattern == options.regex_engine;
+    }
+
+    bool active() const { return !revs.empty() || regex.has_value(); }
+
+    bool matches(const std::string &name) {
+        const auto it = verdicts.find(name);
+
+        if (it != verdicts.end()) {
+            return it->second;
+        }
+
+        const bool match = !revs.empty() ? revs.matches(name) : std::regex_match(name, *regex);
+        verdicts.emplace(name, match);
+
+        return match;
+    }
+
+   private:
+    const std::string pattern;
+    const RevisionSet &revs;
+    std::optional<std::regex> regex;
+    phmap::flat_hash_map<std::string, bool> verdicts;
+};
+
+/// @brief The engine filter of the calling thread, created on first use
+/// @param options
+/// @return
+EngineFilter &local_engine_filter(const Options &options) {
+    thread_local std::unique_ptr<EngineFilter> filter;
+
+    if (filter == nullptr || !filter->uses(options)) {
+        filter = std::make_unique<EngineFilter>(options);
+    }
+
+    return *filter;
+}
+
 /// @brief Analyze a file with pgn games and update the position map, apply filter if present
 class Analyze : public pgn::Visitor {
    public:
-    Analyze(const std::string &regex_engine, const map_fens &fixfen_map, const int bin_width)
-        : regex_engine(regex_engine), fixfen_map(fixfen_map), bin_width(bin_width) {}
+    Analyze(const Options &options, map_local_t *local_map, DenseCounts *dense,
+            std::set<std::string> *engines)
+        : engine_filter(local_engine_filter(options)),
+          fixfen(options.fixfen),
+          bin_width(options.bin_width),
+          move_max(options.move_max),
+          verify_san(options.verify_san),
+          local_map(local_map),
+          dense(dense),
+          engines(engines) {
+        for (int eval = -1000; eval <= 1000; eval++) {
+            // reduce precision
+            binned_evals[eval + 1000] = int(std::round(eval / float(bin_width))) * bin_width;
+        }
+    }
 
     virtual ~Analyze() {}
 
+    /// @brief Number of games analysed so far
+    std::size_t games() const { return n_games; }
+
     void startPgn() override {}
 
     void startMoves() override {
         if (!skip) {
-            total_games++;
+            n_games++;
         }
 
-        do_filter = !regex_engine.empty();
+        do_filter = engine_filter.active();
 
-        if (do_filter) {
-            if (white.empty() || black.empty()) {
-                return;
+        if (do_filter && !white.empty() && !black.empty()) {
+            if (engines != nullptr) {
+                engines->insert(white);
+                engines->insert(black);
             }
 
-            std::regex regex(regex_engine);
-
-            if (std::regex_match(white, regex)) {
+            if (engine_filter.matches(white)) {
                 filter_side = Color::WHITE;
             }
 
-            if (std::regex_match(black, regex)) {
+            if (engine_filter.matches(black)) {
                 if (filter_side == Color::NONE) {
                     filter_side = Color::BLACK;
                 } else {
@@ -84,35 +271,39 @@ class Analyze : public pgn::Visitor {
                 }
             }
         }
+
+        // no position of this game is counted, let the parser jump to the next game
+        if (skip || (do_filter && filter_side == Color::NONE)) {
+            skipPgn(true);
+        }
     }
 
     void header(std::string_view key, std::string_view value) override {
         if (key == "FEN") {
-            std::regex p("^(.+) 0 1$");
-            std::smatch match;
-            std::string value_str(value);
+            set_fen(value);
 
             // revert changes by cutechess-cli to move counters
-            if (!fixfen_map.empty() && std::regex_search(value_str, match, p) && match.size() > 1) {
-                std::string fen = match[1];
-                auto it         = fixfen_map.find(fen);
+            if (!fixfen.empty() && value.size() > 4 && ends_with(value, " 0 1")) {
+                const auto fen = value.substr(0, value.size() - 4);
+
+                fixed_counters = fixfen.find(fen);
 
-                if (it == fixfen_map.end()) {
+                if (!fixed_counters) {
                     std::cerr << "Could not find FEN " << fen << " in fixFENsource." << std::endl;
                     std::exit(1);
                 }
 
-                const auto &fix = it->second;
-                std::string fixed_value =
-                    fen + " " + std::to_string(fix.first) + " " + std::to_string(fix.second);
-                board.setFen(fixed_value);
-            } else {
-                board.setFen(value);
+                board.setMoveCounters(fixed_counters->first, fixed_counters->second);
             }
         }
 
         if (key == "Variant" && value == "fischerandom") {
             board.set960(true);
+
+            // set960 sets up the position again from the FEN with the unfixed counters
+            if (fixed_counters) {
+                board.setMoveCounters(fixed_counters->first, fixed_counters->second);
+            }
         }
 
         if (key == "Result") {
@@ -156,66 +347,121 @@ class Analyze : public pgn::Visitor {
             return;
         }
 
-        if (board.fullMoveNumber() > 200) {
+        // no later position of this game is counted, let the parser jump to the next game
+        if (int(board.fullMoveNumber()) > move_max) {
+            skipPgn(true);
             return;
         }
 
-        // openbench uses Nf3 {+0.57 17/28 583 363004}, fishtest Nf3 {+0.57/17}
-        const size_t delimiter_pos = comment.find_first_of(" /");
-
         Key key;
-        key.eval = 1002;
+        key.eval = NO_EVAL;
 
         if (!do_filter || filter_side == board.sideToMove()) {
-            if (delimiter_pos != std::string::npos && comment != "book") {
-                const auto match_eval = comment.substr(0, delimiter_pos);
+            key.eval = parse_eval(comment);
+        }
 
-                if (match_eval[1] == 'M') {
-                    if (match_eval[0] == '+') {
-                        key.eval = 1001;
-                    } else {
-                        key.eval = -1001;
-                    }
+        // an eval was found
+        if (key.eval != NO_EVAL) {
+            key.result   = board.sideToMove() == Color::WHITE ? resultkey.white : resultkey.black;
+            key.move     = board.fullMoveNumber();
+            key.material = material;
 
-                } else {
-                    int eval = 100 * fast_stof(match_eval.data());
+            // insert or update the position map
+            if (!PackedKey::fits(key)) {
+                count_unpacked(key, 1);
+            } else if (dense != nullptr && dense->add(key)) {
+                // counted in the dense counters
+            } else if (local_map != nullptr) {
+                (*local_map)[PackedKey(key)]++;
+            } else {
+                pos_map.lazy_emplace_l(
+                    PackedKey(key), [&](map_t::value_type &v) { v.second += 1; },
+                    [&](const map_t::constructor &ctor) { ctor(PackedKey(key), 1); });
+            }
+        }
 
-                    if (eval > 1000) {
-                        eval = 1000;
-                    } else if (eval < -1000) {
-                        eval = -1000;
-                    }
+        const Move m = resolve_san(move);
 
-                    // reduce precision
-                    key.eval = int(std::round(eval / float(bin_width))) * bin_width;
-                }
-            }
+        // keep the material up to date, only captures and promotions change it
+        if (m.typeOf() == Move::ENPASSANT) {
+            material -= 1;
+        } else if (m.typeOf() != Move::CASTLING) {
+            material -= piece_value(board.at<PieceType>(m.to()));
         }
 
-        // an eval was found
-        if (key.eval != 1002) {
-            const auto knights = board.pieces(PieceType::KNIGHT).count();
-            const auto bishops = board.pieces(PieceType::BISHOP).count();
-            const auto rooks   = board.pieces(PieceType::ROOK).count();
-            const auto queens  = board.pieces(PieceType::QUEEN).count();
-            const auto pawns   = board.pieces(PieceType::PAWN).count();
+        if (m.typeOf() == Move::PROMOTION) {
+            material += piece_value(m.promotionType()) - 1;
+        }
 
-            key.result   = board.sideToMove() == Color::WHITE ? resultkey.white : resultkey.black;
-            key.move     = board.fullMoveNumber();
-            key.material = 9 * queens + 5 * rooks + 3 * bishops + 3 * knights + pawns;
+        board.makeMove<true>(m);
+    }
 
-            // insert or update the position map
-            pos_map.lazy_emplace_l(
-                std::move(key), [&](map_t::value_type &v) { v.second += 1; },
-                [&](const map_t::constructor &ctor) { ctor(std::move(key), 1); });
+    /// @brief Parse the eval of a move comment with the parser of the format of this stream, which
+    /// is detected from the first comment with an eval, and reduce its precision to the bin width.
+    /// @param comment
+    /// @return
+    int parse_eval(std::string_view comment) {
+        int eval;
+
+        switch (eval_format) {
+            case EvalFormat::FISHTEST:
+                eval = ::parse_eval<EvalFormat::FISHTEST>(comment);
+                break;
+            case EvalFormat::OPENBENCH:
+                eval = ::parse_eval<EvalFormat::OPENBENCH>(comment);
+                break;
+            default:
+                eval        = ::parse_eval<EvalFormat::UNKNOWN>(comment);
+                eval_format = sniff_eval_format(comment);
+        }
+
+        if (eval == NO_EVAL || eval == MATE_EVAL || eval == -MATE_EVAL) {
+            return eval;
+        }
+
+        return binned_evals[eval + 1000];
+    }
+
+    /// @brief Value of a piece in the material count, 0 for kings and empty squares
+    /// @param pt
+    /// @return
+    static int piece_value(PieceType pt) {
+        constexpr int values[] = {1, 3, 3, 5, 9, 0, 0};
+        return values[static_cast<int>(pt.internal())];
+    }
+
+    /// @brief Set up the board from a FEN and count its material 9Q + 5R + 3B + 3N + P.
+    /// @param fen
+    void set_fen(std::string_view fen) {
+        board.setFen(fen);
+
+        material = 0;
+
+        for (const auto pt : {PieceType::PAWN, PieceType::KNIGHT, PieceType::BISHOP,
+                              PieceType::ROOK, PieceType::QUEEN}) {
+            material += piece_value(pt) * board.pieces(pt).count();
+        }
+    }
+
+    /// @brief Resolve a SAN move in the current position, trusting the engines' pgns to be legal.
+    /// @param san
+    /// @return
+    Move resolve_san(std::string_view san) {
+        const Move move = uci::parseSanTrusted(board, san, moves);
+
+        if (verify_san && move != uci::parseSan(board, san, moves)) {
+            throw std::runtime_error("Fast SAN resolution differs from the legal move for " +
+                                     std::string(san) + " in " + board.getFen());
         }
 
-        board.makeMove<true>(uci::parseSan(board, move, moves));
+        return move;
     }
 
     void endPgn() override {
         board.set960(false);
-        board.setFen(constants::STARTPOS);
+        set_fen(constants::STARTPOS);
+
+        fixed_counters.reset();
 
         goodTermination = true;
         hasResult       = false;
@@ -228,13 +474,33 @@ class Analyze : public pgn::Visitor {
     }
 
    private:
-    const std::string &regex_engine;
-    const map_fens &fixfen_map;
+    EngineFilter &engine_filter;
+    const fixfenindex::Index &fixfen;
     const int bin_width;
+    const int move_max;
+    const bool verify_san;
+    map_local_t *const local_map;
+    DenseCounts *const dense;
+    // names given to the engine filter, if they are collected
+    std::set<std::string> *const engines;
+
+    std::size_t n_games = 0;
+
+    // evals in [-1000, 1000] rounded to the bin width
+    std::array<int, 2001> binned_evals;
+
+    // format of the move comments, detected from the first comment with an eval
+    EvalFormat eval_format = EvalFormat::UNKNOWN;
 
     Board board;
     Movelist moves;
 
+    // material of the current position, 78 for the starting position
+    int material = 78;
+
+    // move counters of the FEN header, corrected with the fixFENsource
+    std::optional<std::pair<int, int>> fixed_counters;
+
     bool skip = false;
 
     bool goodTermination = true;
@@ -250,80 +516,252 @@ class Analyze : public pgn::Visitor {
     ResultKey resultkey;
 };
 
-void ana_files(const std::vector<std::string> &files, const std::string &regex_engine,
-               const map_fens &fixfen_map, const int bin_width) {
-    for (const auto &file : files) {
-        const auto pgn_iterator = [&](std::istream &iss) {
-            auto vis = std::make_unique<Analyze>(regex_engine, fixfen_map, bin_width);
+/// @brief Counts of a single task, kept apart for the result cache: the positions, and the
+/// names of the engines whose verdicts of the engine filter decided which positions are counted
+struct TaskCounts {
+    map_local_t map;
+    std::set<std::string> engines;
+};
 
-            pgn::StreamParser parser(iss);
+/// @brief Analyse the games in a stream.
+/// @param iss
+/// @param file
+/// @param options
+/// @param task if given, count the positions in this task instead of the maps chosen by
+/// options.aggregation
+/// @return number of games analysed, or nothing if the games could not be parsed
+std::optional<std::size_t> ana_stream(std::istream &iss, const std::string &file,
+                                      const Options &options, TaskCounts *task) {
+    map_local_t *local_map = task != nullptr ? &task->map : nullptr;
+    DenseCounts *dense     = nullptr;
+
+    if (task == nullptr && options.aggregation != Aggregation::SHARED) {
+        local_map = &local_pos_map();
+    }
 
-            try {
-                parser.readGames(*vis);
-            } catch (const std::exception &e) {
-                std::cout << "Error when parsing: " << file << std::endl;
-                std::cerr << e.what() << '\n';
-            }
-        };
+    if (task == nullptr && options.aggregation == Aggregation::DENSE) {
+        dense = &local_dense_counts(options.bin_width);
+    }
 
-        if (file.size() >= 3 && file.substr(file.size() - 3) == ".gz") {
-            igzstream input(file.c_str());
-            pgn_iterator(input);
-        } else {
-            std::ifstream pgn_stream(file);
-            pgn_iterator(pgn_stream);
-            pgn_stream.close();
+    auto vis = std::make_unique<Analyze>(options, local_map, dense,
+                                         task != nullptr ? &task->engines : nullptr);
+
+    pgn::StreamParser parser(iss, options.block_size);
+
+    bool parsed = true;
+
+    try {
+        parser.readGames(*vis);
+    } catch (const std::exception &e) {
+        std::cout << "Error when parsing: " << file << std::endl;
+        std::cerr << e.what() << '\n';
+        parsed = false;
+    }
+
+    total_games += vis->games();
+
+    if (!parsed) {
+        return std::nullopt;
+    }
+
+    return vis->games();
+}
+
+/// @brief Analyse the games of a whole file.
+/// @param file
+/// @param options
+/// @param task see ana_stream()
+/// @param build_index build the index of a .pgn.gz file while reading it, for a file without
+/// an index of options.index_span
+/// @return
+std::optional<std::size_t> ana_file(const std::string &file, const Options &options,
+                                    TaskCounts *task = nullptr, bool build_index = false) {
+    const bool is_gz = file.size() >= 3 && file.substr(file.size() - 3) == ".gz";
+
+    if (is_gz && build_index) {
+        // build the index while reading the file, for later runs to split it
+        gzindex::InputStream input(file, options.index_span);
+        const auto games = ana_stream(input, file, options, task);
+
+        if (const auto index = input.buf.reader.index(file)) {
+            index->save(file);
         }
+
+        return games;
+    } else if (is_gz) {
+        GzipInputStream input(file);
+        return ana_stream(input, file, options, task);
+    } else {
+        std::ifstream pgn_stream(file);
+        return ana_stream(pgn_stream, file, options, task);
     }
 }
 
-}  // namespace analysis
+/// @brief Part of a memory mapped pgn file, starting at a game boundary
+struct PgnRange {
+    std::string file;
+    std::shared_ptr<const MappedFile> mapping;
+    std::string_view data;
+};
+
+std::optional<std::size_t> ana_range(const PgnRange &range, const Options &options,
+                                     TaskCounts *task = nullptr) {
+    MemoryInputStream input(range.data);
+    return ana_stream(input, range.file, options, task);
+}
+
+/// @brief Games between two access points of the index of a .pgn.gz file
+struct GzRange {
+    std::string file;
+    std::shared_ptr<const gzindex::Index> index;
+    std::size_t point;
+};
+
+std::optional<std::size_t> ana_gz_range(const GzRange &range, const Options &options,
+                                        TaskCounts *task = nullptr) {
+    const auto &points = range.index->points;
+    const auto *last   = range.point + 1 < points.size() ? &points[range.point + 1] : nullptr;
+
+    gzindex::InputStream input(range.file, points[range.point], last);
+    return ana_stream(input, range.file, options, task);
+}
 
-[[nodiscard]] map_fens get_fixfen(std::string file) {
-    map_fens fixfen_map;
-    if (file.empty()) {
-        return fixfen_map;
+/// @brief Analyse a file or part of a file through the result cache. A cached result is added to
+/// the counts instead of analysing the games again, otherwise the games are counted in a map of
+/// their own, which is stored in the cache before it is added to the counts. An entry also holds
+/// the verdicts of the engine filter for the engines of its games, and is only used while the
+/// engine filter still gives the same verdicts, such that a new set of revisions does not
+/// invalidate the entries of files whose engines it matches as before.
+/// @param cache
+/// @param file
+/// @param part describes the part of the file, empty for the whole file
+/// @param options
+/// @param analyse analyses the games, counting them in the given task
+void ana_cached(const resultcache::Cache &cache, const std::string &file, const std::string &part,
+                const Options &options,
+                const std::function<std::optional<std::size_t>(TaskCounts *)> &analyse) {
+    auto &engine_filter = local_engine_filter(options);
+    auto entry          = cache.load(file, part);
+
+    if (entry && !std::all_of(entry->engines.begin(), entry->engines.end(),
+                              [&engine_filter](const auto &engine) {
+                                  return engine_filter.matches(engine.first) == engine.second;
+                              })) {
+        entry.reset();
     }
 
-    const auto fen_iterator = [&](std::istream &iss) {
-        std::string line;
-        while (std::getline(iss, line)) {
-            std::istringstream iss(line);
-            std::string f1, f2, f3, ep;
-            int halfmove, fullmove = 0;
+    if (entry) {
+        cache.hit();
+        total_games += entry->games;
+    } else {
+        // stat before analysing, so that the entry never pairs a newer file with older counts
+        const auto stat = binaryio::stat(file);
 
-            iss >> f1 >> f2 >> f3 >> ep >> halfmove >> fullmove;
+        TaskCounts task;
+        const auto unpacked = total_unpacked.load();
+        const auto games    = analyse(&task);
 
-            if (!fullmove) continue;
+        entry.emplace();
+        entry->records.assign(task.map.begin(), task.map.end());
+        std::sort(entry->records.begin(), entry->records.end());
 
-            auto key         = f1 + ' ' + f2 + ' ' + f3 + ' ' + ep;
-            auto fixfen_data = std::pair<int, int>(halfmove, fullmove);
+        for (const auto &engine : task.engines) {
+            entry->engines.emplace_back(engine, engine_filter.matches(engine));
+        }
 
-            if (fixfen_map.find(key) != fixfen_map.end()) {
-                // for duplicate FENs, prefer the one with lower full move counter
-                if (fullmove < fixfen_map[key].second) {
-                    fixfen_map[key] = fixfen_data;
-                }
-            } else {
-                fixfen_map[key] = fixfen_data;
-            }
+        // files with parsing errors are analysed again next time, and so are files that may have
+        // positions outside of the records, counted as unpacked keys by this or another task
+        if (games && total_unpacked == unpacked) {
+            entry->games = *games;
+            cache.store(file, part, *entry, stat);
         }
-    };
+    }
 
-    if (file.size() >= 3 && file.substr(file.size() - 3) == ".gz") {
-        igzstream input(file.c_str());
-        fen_iterator(input);
+    if (options.aggregation == Aggregation::SHARED) {
+        for (const auto &[key, count] : entry->records) {
+            pos_map.lazy_emplace_l(
+                key, [&](map_t::value_type &v) { v.second += count; },
+                [&](const map_t::constructor &ctor) { ctor(key, count); });
+        }
     } else {
-        std::ifstream input(file);
-        fen_iterator(input);
+        auto &local_map = local_pos_map();
+
+        for (const auto &[key, count] : entry->records) {
+            local_map[key] += count;
+        }
     }
+}
+
+/// @brief Merge maps pairwise in parallel, such that maps.front() holds the sum of all maps.
+/// @param maps
+/// @param concurrency
+void merge_maps(std::vector<std::unique_ptr<map_local_t>> &maps, int concurrency) {
+    for (std::size_t stride = 1; stride < maps.size(); stride *= 2) {
+        ThreadPool pool(concurrency);
+
+        for (std::size_t i = 0; i + stride < maps.size(); i += 2 * stride) {
+            pool.enqueue([&maps, i, stride]() {
+                // merge the smaller map into the larger one
+                if (maps[i]->size() < maps[i + stride]->size()) {
+                    std::swap(maps[i], maps[i + stride]);
+                }
+
+                auto &target = *maps[i];
+
+                for (const auto &pair : *maps[i + stride]) {
+                    target[pair.first] += pair.second;
+                }
+
+                maps[i + stride].reset();
+            });
+        }
 
-    return fixfen_map;
+        pool.wait();
+    }
 }
 
-[[nodiscard]] map_meta get_metadata(const std::vector<std::string> &file_list,
-                                    bool allow_duplicates) {
-    map_meta meta_map;
+/// @brief Sum dense counters in parallel, such that tables.front() holds the sum of all tables.
+/// @param tables
+/// @param concurrency
+void merge_dense(std::vector<std::unique_ptr<DenseCounts>> &tables, int concurrency) {
+    if (tables.size() < 2) {
+        return;
+    }
+
+    const std::size_t size  = tables.front()->size();
+    const std::size_t slice = (size + concurrency - 1) / concurrency;
+
+    ThreadPool pool(concurrency);
+
+    for (std::size_t begin = 0; begin < size; begin += slice) {
+        pool.enqueue([&tables, begin, end = std::min(size, begin + slice)]() {
+            for (std::size_t t = 1; t < tables.size(); t++) {
+                tables.front()->add(*tables[t], begin, end);
+            }
+        });
+    }
+
+    pool.wait();
+
+    tables.resize(1);
+}
+
+}  // namespace analysis
+
+/// @brief The path of a test's files without extension, e.g. dir/abcd for dir/abcd-3.pgn.gz
+/// @param pathname
+/// @return
+[[nodiscard]] std::string test_path(const std::string &pathname) {
+    fs::path path(pathname);
+    std::string filename = path.filename().string();
+    std::string test_id  = filename.substr(0, filename.find_first_of("-."));
+    return (path.parent_path() / test_id).string();
+}
+
+/// @brief Check that the files of each test are in a single directory.
+/// @param file_list
+/// @param allow_duplicates only warn about tests in several directories
+void check_duplicate_tests(const std::vector<std::string> &file_list, bool allow_duplicates) {
     // map to check for duplicate tests
     std::unordered_map<std::string, std::string> test_map;
     std::set<std::string> test_warned;
@@ -349,47 +787,185 @@ void ana_files(const std::vector<std::string> &files, const std::string &regex_e
                 }
             }
         }
+    }
+}
+
+/// @brief Load the metadata of the tests of the files in parallel, each test's json only once.
+/// @param file_list
+/// @param concurrency
+/// @param index if given, the metadata of tests whose json did not change is taken from it, and
+/// the metadata of the others is added to it
+/// @return
+[[nodiscard]] map_meta get_metadata(const std::vector<std::string> &file_list, int concurrency,
+                                    metaindex::Index *index = nullptr) {
+    std::vector<std::string> tests;
+    std::unordered_set<std::string> seen;
+
+    for (const auto &pathname : file_list) {
+        auto test_filename = test_path(pathname);
+
+        if (seen.insert(test_filename).second) {
+            tests.push_back(std::move(test_filename));
+        }
+    }
+
+    std::vector<std::optional<TestMetaData>> metadata(tests.size());
+    std::vector<std::optional<binaryio::FileStat>> stats(tests.size());
+    std::vector<char> invalid(tests.size(), false), indexed(tests.size(), false);
+
+    ThreadPool pool(concurrency);
+
+    for (std::size_t i = 0; i < tests.size(); i++) {
+        pool.enqueue([&tests, &metadata, &stats, &invalid, &indexed, index, i]() {
+            const auto json_filename = tests[i] + ".json";
+
+            if (index != nullptr) {
+                stats[i] = binaryio::stat(json_filename);
+
+                if (!stats[i]) return;
+
+                if (const auto *meta = index->find(tests[i], *stats[i])) {
+                    metadata[i] = *meta;
+                    indexed[i]  = true;
+                    return;
+                }
+            }
+
+            std::ifstream json_file(json_filename);
+
+            if (!json_file.is_open()) return;
+
+            metadata[i] = TestMetaDataReader::read(json_file);
+            invalid[i]  = !metadata[i].has_value();
+        });
+    }
+
+    pool.wait();
 
-        // load the JSON data from disk, only once for each test
-        if (meta_map.find(test_filename) == meta_map.end()) {
-            std::ifstream json_file(test_filename + ".json");
+    map_meta meta_map;
 
-            if (!json_file.is_open()) continue;
+    for (std::size_t i = 0; i < tests.size(); i++) {
+        if (invalid[i]) {
+            std::cout << "Error: Failed to parse " << tests[i] << ".json" << std::endl;
+            std::exit(1);
+        }
 
-            json metadata = json::parse(json_file);
+        if (index != nullptr && !indexed[i]) {
+            if (metadata[i] && stats[i]) {
+                index->insert(tests[i], *stats[i], *metadata[i]);
+            } else {
+                index->erase(tests[i]);
+            }
+        }
 
-            meta_map[test_filename] = metadata.get<TestMetaData>();
+        if (metadata[i]) {
+            meta_map.emplace(tests[i], std::move(*metadata[i]));
         }
     }
 
     return meta_map;
 }
 
-template <typename STRATEGY>
-void filter_files(std::vector<std::string> &file_list, const map_meta &meta_map,
-                  const STRATEGY &strategy) {
-    const auto applier = [&](const std::string &pathname) {
-        fs::path path(pathname);
-        std::string filename      = path.filename().string();
-        std::string test_id       = filename.substr(0, filename.find_first_of("-."));
-        std::string test_filename = (path.parent_path() / test_id).string();
-        return strategy.apply(test_filename, meta_map);
-    };
-    const auto it = std::remove_if(file_list.begin(), file_list.end(), applier);
-    file_list.erase(it, file_list.end());
+/// @brief Estimate the normalized Elo difference of a test from its pentanomial statistics.
+/// @param pentanomial
+/// @return
+double pentanomialToEloDiff(const std::vector<int> &pentanomial) {
+    auto pairs            = std::accumulate(pentanomial.begin(), pentanomial.end(), 0);
+    const double WW       = double(pentanomial[4]) / pairs;
+    const double WD       = double(pentanomial[3]) / pairs;
+    const double WLDD     = double(pentanomial[2]) / pairs;
+    const double LD       = double(pentanomial[1]) / pairs;
+    const double LL       = double(pentanomial[0]) / pairs;
+    const double score    = WW + 0.75 * WD + 0.5 * WLDD + 0.25 * LD;
+    const double WW_dev   = WW * std::pow((1 - score), 2);
+    const double WD_dev   = WD * std::pow((0.75 - score), 2);
+    const double WLDD_dev = WLDD * std::pow((0.5 - score), 2);
+    const double LD_dev   = LD * std::pow((0.25 - score), 2);
+    const double LL_dev   = LL * std::pow((0 - score), 2);
+    const double variance = WW_dev + WD_dev + WLDD_dev + LD_dev + LL_dev;
+    return (score - 0.5) / std::sqrt(2 * variance) * (800 / std::log(10));
 }
 
+/// @brief Regex that remembers its verdict for every string it was matched against, as many
+/// tests share the same book, tc or revision.
+class CachedRegex {
+   public:
+    explicit CachedRegex(const std::regex &regex) : regex(regex) {}
+
+    bool match(const std::string &str) const {
+        const auto [it, inserted] = verdicts.try_emplace(str, false);
+
+        if (inserted) {
+            it->second = std::regex_match(str, regex);
+        }
+
+        return it->second;
+    }
+
+   private:
+    std::regex regex;
+    mutable std::unordered_map<std::string, bool> verdicts;
+};
+
+/// @brief All filters of a run, evaluated in a single pass over the files. The files are grouped
+/// by test, such that each test's metadata is looked up and the filters are evaluated only once
+/// per test.
+class FilterStage {
+   public:
+    /// @brief Add a filter, whose apply(test, meta) returns true for tests to remove. meta is
+    /// nullptr for tests without metadata.
+    /// @tparam STRATEGY
+    /// @param strategy
+    template <typename STRATEGY>
+    void add(STRATEGY strategy) {
+        strategies.emplace_back(
+            [strategy = std::move(strategy)](const std::string &test, const TestMetaData *meta) {
+                return strategy.apply(test, meta);
+            });
+    }
+
+    bool empty() const { return strategies.empty(); }
+
+    /// @brief Remove the files of all tests that one of the filters rejects.
+    /// @param file_list
+    /// @param meta_map
+    void apply(std::vector<std::string> &file_list, const map_meta &meta_map) const {
+        std::unordered_map<std::string, bool> removed;
+
+        const auto applier = [&](const std::string &pathname) {
+            auto test                 = test_path(pathname);
+            const auto [it, inserted] = removed.try_emplace(std::move(test), false);
+
+            if (inserted) {
+                const auto meta          = meta_map.find(it->first);
+                const TestMetaData *data = meta == meta_map.end() ? nullptr : &meta->second;
+
+                it->second = std::any_of(strategies.begin(), strategies.end(),
+                                         [&](const auto &f) { return f(it->first, data); });
+            }
+
+            return it->second;
+        };
+
+        const auto it = std::remove_if(file_list.begin(), file_list.end(), applier);
+        file_list.erase(it, file_list.end());
+    }
+
+   private:
+    std::vector<std::function<bool(const std::string &, const TestMetaData *)>> strategies;
+};
+
 class BookFilterStrategy {
-    std::regex regex_book;
+    CachedRegex regex_book;
     bool invert;
 
    public:
     BookFilterStrategy(const std::regex &rb, bool inv) : regex_book(rb), invert(inv) {}
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
+    bool apply(const std::string &, const TestMetaData *meta) const {
         // check if metadata and "book" entry exist
-        if (meta_map.find(filename) != meta_map.end() && meta_map.at(filename).book.has_value()) {
-            bool match = std::regex_match(meta_map.at(filename).book.value(), regex_book);
+        if (meta != nullptr && meta->book.has_value()) {
+            bool match = regex_book.match(meta->book.value());
             return invert ? match : !match;
         }
 
@@ -399,23 +975,26 @@ class BookFilterStrategy {
 };
 
 class RevFilterStrategy {
-    std::regex regex_rev;
+    std::function<bool(const std::string &)> match_rev;
 
    public:
-    RevFilterStrategy(const std::regex &rb) : regex_rev(rb) {}
+    RevFilterStrategy(const std::regex &rb)
+        : match_rev(
+              [regex = CachedRegex(rb)](const std::string &rev) { return regex.match(rev); }) {}
+
+    RevFilterStrategy(const RevisionSet &revs)
+        : match_rev([revs](const std::string &rev) { return revs.matches(rev); }) {}
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        if (meta_map.find(filename) == meta_map.end()) {
+    bool apply(const std::string &, const TestMetaData *meta) const {
+        if (meta == nullptr) {
             return true;
         }
 
-        if (meta_map.at(filename).resolved_base.has_value() &&
-            std::regex_match(meta_map.at(filename).resolved_base.value(), regex_rev)) {
+        if (meta->resolved_base.has_value() && match_rev(meta->resolved_base.value())) {
             return false;
         }
 
-        if (meta_map.at(filename).resolved_new.has_value() &&
-            std::regex_match(meta_map.at(filename).resolved_new.value(), regex_rev)) {
+        if (meta->resolved_new.has_value() && match_rev(meta->resolved_new.value())) {
             return false;
         }
 
@@ -424,22 +1003,22 @@ class RevFilterStrategy {
 };
 
 class TcFilterStrategy {
-    std::regex regex_tc;
+    CachedRegex regex_tc;
 
    public:
     TcFilterStrategy(const std::regex &rb) : regex_tc(rb) {}
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        if (meta_map.find(filename) == meta_map.end()) {
+    bool apply(const std::string &, const TestMetaData *meta) const {
+        if (meta == nullptr) {
             return true;
         }
 
-        if (meta_map.at(filename).new_tc.has_value() && meta_map.at(filename).tc.has_value()) {
-            if (meta_map.at(filename).new_tc.value() != meta_map.at(filename).tc.value()) {
+        if (meta->new_tc.has_value() && meta->tc.has_value()) {
+            if (meta->new_tc.value() != meta->tc.value()) {
                 return true;
             }
 
-            if (std::regex_match(meta_map.at(filename).tc.value(), regex_tc)) {
+            if (regex_tc.match(meta->tc.value())) {
                 return false;
             }
         }
@@ -454,13 +1033,12 @@ class ThreadsFilterStrategy {
    public:
     ThreadsFilterStrategy(int t) : threads(t) {}
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        if (meta_map.find(filename) == meta_map.end()) {
+    bool apply(const std::string &, const TestMetaData *meta) const {
+        if (meta == nullptr) {
             return true;
         }
 
-        if (meta_map.at(filename).threads.has_value() &&
-            meta_map.at(filename).threads.value() == threads) {
+        if (meta->threads.has_value() && meta->threads.value() == threads) {
             return false;
         }
 
@@ -474,33 +1052,16 @@ class EloFilterStrategy {
    public:
     EloFilterStrategy(double mi, double ma) : EloDiffMin(mi), EloDiffMax(ma) {}
 
-    double pentanomialToEloDiff(const std::vector<int> &pentanomial) const {
-        auto pairs            = std::accumulate(pentanomial.begin(), pentanomial.end(), 0);
-        const double WW       = double(pentanomial[4]) / pairs;
-        const double WD       = double(pentanomial[3]) / pairs;
-        const double WLDD     = double(pentanomial[2]) / pairs;
-        const double LD       = double(pentanomial[1]) / pairs;
-        const double LL       = double(pentanomial[0]) / pairs;
-        const double score    = WW + 0.75 * WD + 0.5 * WLDD + 0.25 * LD;
-        const double WW_dev   = WW * std::pow((1 - score), 2);
-        const double WD_dev   = WD * std::pow((0.75 - score), 2);
-        const double WLDD_dev = WLDD * std::pow((0.5 - score), 2);
-        const double LD_dev   = LD * std::pow((0.25 - score), 2);
-        const double LL_dev   = LL * std::pow((0 - score), 2);
-        const double variance = WW_dev + WD_dev + WLDD_dev + LD_dev + LL_dev;
-        return (score - 0.5) / std::sqrt(2 * variance) * (800 / std::log(10));
-    }
-
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        if (meta_map.find(filename) == meta_map.end()) {
+    bool apply(const std::string &, const TestMetaData *meta) const {
+        if (meta == nullptr) {
             return true;
         }
 
-        if (!meta_map.at(filename).pentanomial.has_value()) {
+        if (!meta->pentanomial.has_value()) {
             return true;
         }
 
-        double fileEloDiff = pentanomialToEloDiff(meta_map.at(filename).pentanomial.value());
+        double fileEloDiff = pentanomialToEloDiff(meta->pentanomial.value());
         if (EloDiffMin <= fileEloDiff && fileEloDiff <= EloDiffMax) {
             return false;
         }
@@ -511,10 +1072,9 @@ class EloFilterStrategy {
 
 class SprtFilterStrategy {
    public:
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
+    bool apply(const std::string &, const TestMetaData *meta) const {
         // check if metadata and "sprt" entry exist
-        if (meta_map.find(filename) != meta_map.end() && meta_map.at(filename).sprt.has_value() &&
-            meta_map.at(filename).sprt.value()) {
+        if (meta != nullptr && meta->sprt.has_value() && meta->sprt.value()) {
             return false;
         }
 
@@ -522,69 +1082,859 @@ class SprtFilterStrategy {
     }
 };
 
-void process(const std::vector<std::string> &files_pgn, const std::string &regex_engine,
-             const map_fens &fixfen_map, int concurrency, int bin_width) {
-    // Create more chunks than threads to prevent threads from idling.
-    int target_chunks = 4 * concurrency;
+class ShardFilterStrategy {
+    std::uint64_t index, count;
 
-    auto files_chunked = split_chunks(files_pgn, target_chunks);
+   public:
+    ShardFilterStrategy(std::uint64_t i, std::uint64_t n) : index(i), count(n) {}
 
-    std::cout << "Found " << files_pgn.size() << " .pgn(.gz) files, creating "
-              << files_chunked.size() << " chunks for processing." << std::endl;
+    bool apply(const std::string &test, const TestMetaData *) const {
+        // all files of a test end up in the same shard, on every machine
+        const auto test_id = fs::path(test).filename().string();
+        return fnv1a(test_id) % count != index;
+    }
+};
 
-    // Mutex for progress success
-    std::mutex progress_mutex;
+/// @brief Filter by an expression over the metadata of a test, e.g.
+/// tc~"60\+0.6" && threads==1 && |nElo|<=5
+/// The fields book, tc, new_tc, resolved_base and resolved_new compare as strings with == and !=,
+/// or match a regex with ~. threads, nElo and |nElo| compare as numbers with ==, !=, <, <=, > and
+/// >=, and sprt is true for SPRT tests. Comparisons combine with !, && and || and parentheses.
+/// A comparison with a field missing from the metadata is false.
+class WhereFilterStrategy {
+   public:
+    explicit WhereFilterStrategy(const std::string &expression) : input(expression) {
+        predicate = parse_or();
+        skip_spaces();
 
-    // Create a thread pool
-    ThreadPool pool(concurrency);
+        if (pos != input.size()) {
+            fail("unexpected " + input.substr(pos));
+        }
+    }
 
-    // Print progress
-    std::cout << "\rProgress: " << total_chunks << "/" << files_chunked.size() << std::flush;
+    bool apply(const std::string &, const TestMetaData *meta) const {
+        return meta == nullptr || !predicate(*meta);
+    }
 
-    for (const auto &files : files_chunked) {
-        pool.enqueue(
-            [&files, &regex_engine, &fixfen_map, &progress_mutex, &files_chunked, &bin_width]() {
-                analysis::ana_files(files, regex_engine, fixfen_map, bin_width);
+   private:
+    using Predicate = std::function<bool(const TestMetaData &)>;
 
-                total_chunks++;
+    std::string input;
+    std::size_t pos = 0;
+    Predicate predicate;
 
-                // Limit the scope of the lock
-                {
-                    const std::lock_guard<std::mutex> lock(progress_mutex);
+    [[noreturn]] void fail(const std::string &message) const {
+        std::cout << "Error: Invalid --where expression, " << message << std::endl;
+        std::exit(1);
+    }
 
-                    // Print progress
-                    std::cout << "\rProgress: " << total_chunks << "/" << files_chunked.size()
-                              << std::flush;
-                }
-            });
+    void skip_spaces() {
+        while (pos < input.size() && std::isspace(static_cast<unsigned char>(input[pos]))) {
+            pos++;
+        }
     }
 
-    // Wait for all threads to finish
+    bool accept(std::string_view token) {
+        skip_spaces();
+
+        if (std::string_view(input).substr(pos, token.size()) == token) {
+            pos += token.size();
+            return true;
+        }
+
+        return false;
+    }
+
+    Predicate parse_or() {
+        auto lhs = parse_and();
+
+        while (accept("||")) {
+            lhs = [lhs, rhs = parse_and()](const TestMetaData &m) { return lhs(m) || rhs(m); };
+        }
+
+        return lhs;
+    }
+
+    Predicate parse_and() {
+        auto lhs = parse_unary();
+
+        while (accept("&&")) {
+            lhs = [lhs, rhs = parse_unary()](const TestMetaData &m) { return lhs(m) && rhs(m); };
+        }
+
+        return lhs;
+    }
+
+    Predicate parse_unary() {
+        if (accept("!")) {
+            return [operand = parse_unary()](const TestMetaData &m) { return !operand(m); };
+        }
+
+        if (accept("(")) {
+            auto inner = parse_or();
+
+            if (!accept(")")) {
+                fail("missing )");
+            }
+
+            return inner;
+        }
+
+        return parse_comparison();
+    }
+
+    std::string parse_field() {
+        skip_spaces();
+
+        if (accept("|nElo|")) {
+            return "|nElo|";
+        }
+
+        const auto begin = pos;
+
+        while (pos < input.size() && (std::isalnum(static_cast<unsigned char>(input[pos])) ||
+                                      input[pos] == '_')) {
+            pos++;
+        }
+
+        if (begin == pos) {
+            fail("expected a field at " + input.substr(pos));
+        }
+
+        return input.substr(begin, pos - begin);
+    }
+
+    std::string parse_string() {
+        if (!accept("\"")) {
+            fail("expected a quoted string at " + input.substr(pos));
+        }
+
+        std::string value;
+
+        // \" is a quote, any other backslash is kept for the regex
+        while (pos < input.size() && input[pos] != '"') {
+            if (input[pos] == '\\' && pos + 1 < input.size() && input[pos + 1] == '"') {
+                pos++;
+            }
+
+            value += input[pos++];
+        }
+
+        if (!accept("\"")) {
+            fail("unterminated string");
+        }
+
+        return value;
+    }
+
+    /// @brief Parse a decimal number like "-2.5", with fast_stof as the other numbers of the
+    /// program, which does not depend on the locale.
+    /// @return
+    double parse_number() {
+        skip_spaces();
+
+        const auto begin  = pos;
+        const auto digits = [this]() {
+            const auto start = pos;
+
+            while (pos < input.size() && std::isdigit(static_cast<unsigned char>(input[pos]))) {
+                pos++;
+            }
+
+            return pos - start;
+        };
+
+        if (pos < input.size() && (input[pos] == '-' || input[pos] == '+')) {
+            pos++;
+        }
+
+        auto count = digits();
+
+        if (pos < input.size() && input[pos] == '.') {
+            pos++;
+            count += digits();
+        }
+
+        const bool trailing =
+            pos < input.size() && (std::isalnum(static_cast<unsigned char>(input[pos])) ||
+                                   input[pos] == '_' || input[pos] == '.');
+
+        // the number must neither be empty nor run into a field or another number, as in 5x
+        if (count == 0 || trailing) {
+            fail("expected a number at " + input.substr(begin));
+        }
+
+        return fast_stof(input.substr(begin, pos - begin).c_str());
+    }
+
+    Predicate parse_comparison() {
+        const auto field = parse_field();
+
+        if (field == "sprt") {
+            return [](const TestMetaData &m) { return m.sprt.value_or(false); };
+        }
+
+        using StringField = std::optional<std::string> TestMetaData::*;
+
+        static const std::unordered_map<std::string, StringField> string_fields = {
+            {"book", &TestMetaData::book},
+            {"tc", &TestMetaData::tc},
+            {"new_tc", &TestMetaData::new_tc},
+            {"resolved_base", &TestMetaData::resolved_base},
+            {"resolved_new", &TestMetaData::resolved_new}};
+
+        if (const auto it = string_fields.find(field); it != string_fields.end()) {
+            const auto member = it->second;
+
+            if (accept("~")) {
+                return [member, regex = CachedRegex(std::regex(parse_string()))](
+                           const TestMetaData &m) {
+                    return (m.*member) && regex.match(*(m.*member));
+                };
+            }
+
+            const bool equal = accept("==");
+
+            if (!equal && !accept("!=")) {
+                fail("expected ==, != or ~ after " + field);
+            }
+
+            return [member, equal, value = parse_string()](const TestMetaData &m) {
+                return (m.*member) && ((*(m.*member) == value) == equal);
+            };
+        }
+
+        std::function<std::optional<double>(const TestMetaData &)> number;
+
+        if (field == "threads") {
+            number = [](const TestMetaData &m) -> std::optional<double> {
+                return m.threads ? std::optional<double>(*m.threads) : std::nullopt;
+            };
+        } else if (field == "nElo" || field == "|nElo|") {
+            const bool absolute = field == "|nElo|";
+
+            number = [absolute](const TestMetaData &m) -> std::optional<double> {
+                if (!m.pentanomial) return std::nullopt;
+                const double elo = pentanomialToEloDiff(*m.pentanomial);
+                return absolute ? std::abs(elo) : elo;
+            };
+        } else {
+            fail("unknown field " + field);
+        }
+
+        std::function<bool(double, double)> compare;
+
+        if (accept("==")) {
+            compare = std::equal_to<double>();
+        } else if (accept("!=")) {
+            compare = std::not_equal_to<double>();
+        } else if (accept("<=")) {
+            compare = std::less_equal<double>();
+        } else if (accept(">=")) {
+            compare = std::greater_equal<double>();
+        } else if (accept("<")) {
+            compare = std::less<double>();
+        } else if (accept(">")) {
+            compare = std::greater<double>();
+        } else {
+            fail("expected a comparison after " + field);
+        }
+
+        return [number, compare, value = parse_number()](const TestMetaData &m) {
+            const auto x = number(m);
+            return x && compare(*x, value);
+        };
+    }
+};
+
+void process(const std::vector<std::string> &files_pgn, const analysis::Options &options,
+             int concurrency) {
+    // Every file, or part of a file, is a task of its own. Tasks are queued largest first, in
+    // terms of bytes on disk, and idle threads pick the next one from the queue. This way the
+    // largest files do not end up at the end of the run, keeping a single thread busy.
+    std::vector<std::pair<std::uintmax_t, std::function<void()>>> tasks;
+    std::size_t split_files = 0;
+
+    // with a cache directory, each task first looks for its result in the cache
+    std::optional<resultcache::Cache> cache;
+
+    if (!options.cache_dir.empty()) {
+        cache.emplace(options.cache_dir, analysis::options_hash(options));
+
+        if (const auto removed = cache->prune()) {
+            std::cout << "Removed " << removed << " entries of other options from the cache in "
+                      << options.cache_dir << std::endl;
+        }
+    }
+
+    using Analyse = std::function<std::optional<std::size_t>(analysis::TaskCounts *)>;
+
+    const auto add_task = [&tasks, &cache, &options](std::uintmax_t size, const std::string &file,
+                                                     std::string part, Analyse analyse) {
+        if (cache) {
+            tasks.emplace_back(size, [&cache, &options, &file, part = std::move(part),
+                                      analyse = std::move(analyse)]() {
+                analysis::ana_cached(*cache, file, part, options, analyse);
+            });
+        } else {
+            tasks.emplace_back(size, [analyse = std::move(analyse)]() { analyse(nullptr); });
+        }
+    };
+
+    for (const auto &file : files_pgn) {
+        const bool is_pgn = file.size() >= 4 && file.substr(file.size() - 4) == ".pgn";
+        const bool is_gz  = file.size() >= 3 && file.substr(file.size() - 3) == ".gz";
+        const auto stat   = binaryio::stat(file);
+
+        // e.g. a file removed since it was found
+        if (!stat) {
+            std::cout << "Warning: Cannot read " << file << ", skipping it" << std::endl;
+            continue;
+        }
+
+        const auto size = stat->first;
+
+        // .pgn.gz files without an index get one while they are read
+        bool build_index = false;
+
+        // .pgn.gz files with an index are split at the access points of the index
+        if (options.index_span > 0 && is_gz) {
+            auto index  = gzindex::Index::load(file, options.index_span);
+            build_index = !index;
+
+            if (index && index->points.size() > 1) {
+                auto shared = std::make_shared<const gzindex::Index>(std::move(*index));
+
+                for (std::size_t point = 0; point < shared->points.size(); point++) {
+                    const auto next = point + 1;
+                    const auto end  = next < shared->points.size() ? shared->points[next].in : size;
+
+                    analysis::GzRange range{file, shared, point};
+
+                    add_task(end - shared->points[point].in, file,
+                             "gz " + std::to_string(options.index_span) + ' ' +
+                                 std::to_string(point),
+                             [range, &options](analysis::TaskCounts *task) {
+                                 return analysis::ana_gz_range(range, options, task);
+                             });
+                }
+
+                split_files++;
+                continue;
+            }
+        }
+
+        // large plain pgn files are memory mapped and split at game boundaries
+        if (options.split_size > 0 && is_pgn && size > options.split_size) {
+            auto mapping = std::make_shared<const MappedFile>(file);
+
+            for (const auto &data : split_pgn(mapping->view(), options.split_size)) {
+                analysis::PgnRange range{file, mapping, data};
+
+                add_task(data.size(), file,
+                         "bytes " + std::to_string(data.data() - mapping->view().data()) + '+' +
+                             std::to_string(data.size()),
+                         [range, &options](analysis::TaskCounts *task) {
+                             return analysis::ana_range(range, options, task);
+                         });
+            }
+
+            split_files++;
+            continue;
+        }
+
+        add_task(size, file, "", [&file, &options, build_index](analysis::TaskCounts *task) {
+            return analysis::ana_file(file, options, task, build_index);
+        });
+    }
+
+    // longest processing time first
+    std::stable_sort(tasks.begin(), tasks.end(),
+                     [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    const std::size_t total_tasks = tasks.size();
+
+    std::cout << "Found " << files_pgn.size() << " .pgn(.gz) files, creating " << total_tasks
+              << " tasks for processing";
+
+    if (split_files > 0) {
+        std::cout << " (" << split_files << " large files are split)";
+    }
+
+    std::cout << "." << std::endl;
+
+    // Mutex for progress success
+    std::mutex progress_mutex;
+
+    // Create a thread pool
+    ThreadPool pool(concurrency);
+
+    // Print progress
+    std::cout << "\rProgress: " << total_chunks << "/" << total_tasks << std::flush;
+
+    for (auto &task : tasks) {
+        pool.enqueue([&task, &progress_mutex, total_tasks]() {
+            task.second();
+
+            total_chunks++;
+
+            // Limit the scope of the lock
+            {
+                const std::lock_guard<std::mutex> lock(progress_mutex);
+
+                // Print progress
+                std::cout << "\rProgress: " << total_chunks << "/" << total_tasks << std::flush;
+            }
+        });
+    }
+
+    // Wait for all threads to finish
     pool.wait();
+
+    if (cache) {
+        std::cout << "\nRead " << cache->loaded() << " of " << total_tasks
+                  << " tasks from the cache in " << options.cache_dir;
+    }
+
+    if (!local_maps.empty()) {
+        const auto t0 = std::chrono::high_resolution_clock::now();
+
+        analysis::merge_maps(local_maps, concurrency);
+        analysis::merge_dense(local_dense, concurrency);
+
+        for (const auto &pair : *local_maps.front()) {
+            pos_map[pair.first] += pair.second;
+        }
+
+        if (!local_dense.empty()) {
+            local_dense.front()->for_each(
+                [](const Key &key, std::uint32_t count) { pos_map[PackedKey(key)] += count; });
+        }
+
+        local_maps.clear();
+        local_dense.clear();
+
+        const auto t1 = std::chrono::high_resolution_clock::now();
+
+        std::cout << "\nMerged thread local maps in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() / 1000.0
+                  << "s";
+    }
 }
 
-/// @brief Save the position map to a json file.
-/// @param json_filename
-void save(const std::string &json_filename) {
-    std::uint64_t total_pos = 0;
+/// @brief Replay the collected positions from concurrency threads, once into a shared map_t and
+/// once into thread local maps that are merged at the end, to compare the two aggregations.
+/// @param concurrency
+void bench_aggregation(int concurrency) {
+    // replay at most this many positions, in the proportions found in pos_map
+    constexpr std::uint64_t max_inserts = std::uint64_t(1) << 25;
 
-    json j;
+    std::uint64_t total_pos = 0;
 
     for (const auto &pair : pos_map) {
-        const auto map_key_t = static_cast<std::string>(pair.first);
-        j[map_key_t]         = pair.second;
         total_pos += pair.second;
     }
 
-    // save json to file
-    std::ofstream out_file(json_filename);
-    out_file << j.dump(2);
+    std::vector<PackedKey> keys;
+
+    for (const auto &pair : pos_map) {
+        const auto n = std::max<std::uint64_t>(1, pair.second * max_inserts / total_pos);
+        keys.insert(keys.end(), n, pair.first);
+    }
+
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(42));
+
+    const auto run = [&keys, concurrency](const auto &insert) {
+        const auto t0 = std::chrono::high_resolution_clock::now();
+
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < concurrency; t++) {
+            threads.emplace_back([&keys, &insert, concurrency, t]() {
+                const auto begin = keys.size() * t / concurrency;
+                const auto end   = keys.size() * (t + 1) / concurrency;
+
+                for (auto i = begin; i < end; i++) {
+                    insert(t, keys[i]);
+                }
+            });
+        }
+
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        const auto t1 = std::chrono::high_resolution_clock::now();
+
+        return std::chrono::duration<double>(t1 - t0).count();
+    };
+
+    map_t shared_map;
+    shared_map.reserve(pos_map.size());
+
+    const double t_shared = run([&shared_map](int, PackedKey key) {
+        shared_map.lazy_emplace_l(
+            key, [&](map_t::value_type &v) { v.second += 1; },
+            [&](const map_t::constructor &ctor) { ctor(key, 1); });
+    });
+
+    std::vector<std::unique_ptr<map_local_t>> maps;
+
+    for (int t = 0; t < concurrency; t++) {
+        maps.push_back(std::make_unique<map_local_t>());
+    }
+
+    double t_local = run([&maps](int t, PackedKey key) { (*maps[t])[key]++; });
+
+    const auto t0 = std::chrono::high_resolution_clock::now();
+    analysis::merge_maps(maps, concurrency);
+    const auto t1 = std::chrono::high_resolution_clock::now();
+
+    const double t_merge = std::chrono::duration<double>(t1 - t0).count();
+    t_local += t_merge;
+
+    std::cout << "Aggregation benchmark, " << keys.size() << " positions from " << concurrency
+              << " threads:\n"
+              << "  shared map:         " << t_shared << "s, " << keys.size() / t_shared / 1e6
+              << " M positions/s\n"
+              << "  thread local maps:  " << t_local << "s, " << keys.size() / t_local / 1e6
+              << " M positions/s (including " << t_merge << "s for merging)" << std::endl;
+}
+
+/// @brief Append the little-endian representation of an unsigned integer to a byte buffer.
+/// @tparam T
+/// @param out
+/// @param value
+template <typename T>
+void put_le(std::string &out, T value) {
+    for (std::size_t i = 0; i < sizeof(T); ++i) out.push_back(char((value >> (8 * i)) & 0xff));
+}
+
+/// @brief Copy the entries of the position map into a vector sorted by key, i.e. in the order of
+/// the (result, move, material, eval) tuples.
+/// @return
+std::vector<std::pair<PackedKey, int>> sorted_records() {
+    std::vector<std::pair<PackedKey, int>> records(pos_map.begin(), pos_map.end());
+    std::sort(records.begin(), records.end());
+    return records;
+}
+
+/// @brief Save the position map to a binary .wdlbin file, which scoreWDL.py can load without
+/// parsing. The 56 byte header holds, all little-endian:
+///   char[8]  magic "WDLBIN01"
+///   uint32   header size in bytes, uint32 bin width
+///   uint64   number of records, scored positions and games
+///   4 x (uint8 shift, uint8 bits, int16 offset)
+///            layout of result, move, material and eval within the record key:
+///            field = ((key >> shift) & ((1 << bits) - 1)) + offset, with results 0, 1, 2
+///            standing for D, L, W
+/// followed by the records, each a uint32 key and a uint32 count, sorted by key.
+/// @param filename
+/// @param bin_width
+void save_binary(const std::string &filename, int bin_width) {
+    if (!unpacked_map.empty()) {
+        std::cout << "Error: " << unpacked_map.size()
+                  << " keys do not fit into the records of a .wdlbin file, write json instead"
+                  << std::endl;
+        std::exit(1);
+    }
+
+    const auto records = sorted_records();
+
+    std::uint64_t total_pos = 0;
+    for (const auto &record : records) total_pos += record.second;
+
+    struct Field {
+        std::uint8_t shift, bits;
+        std::int16_t offset;
+    };
+
+    constexpr Field layout[] = {{27, 2, 0}, {19, 8, 0}, {11, 8, 0}, {0, 11, -1024}};
+
+    std::string header = "WDLBIN01";
+    put_le<std::uint32_t>(header, 56);
+    put_le<std::uint32_t>(header, bin_width);
+    put_le<std::uint64_t>(header, records.size());
+    put_le<std::uint64_t>(header, total_pos);
+    put_le<std::uint64_t>(header, total_games);
+
+    for (const auto &field : layout) {
+        put_le<std::uint8_t>(header, field.shift);
+        put_le<std::uint8_t>(header, field.bits);
+        put_le<std::uint16_t>(header, std::uint16_t(field.offset));
+    }
+
+    assert(header.size() == 56);
+
+    std::string body;
+    body.reserve(8 * records.size());
+
+    for (const auto &record : records) {
+        put_le<std::uint32_t>(body, record.first.value);
+        put_le<std::uint32_t>(body, std::uint32_t(record.second));
+    }
+
+    std::ofstream out_file(filename, std::ios::binary);
+    out_file.write(header.data(), header.size());
+    out_file.write(body.data(), body.size());
     out_file.close();
 
+    if (!out_file) {
+        std::cout << "Error: Failed to write " << filename << std::endl;
+        std::exit(1);
+    }
+
+    std::cout << "Wrote " << total_pos << " scored positions from " << total_games << " games to "
+              << filename << " for analysis." << std::endl;
+}
+
+/// @brief Write the position map as a json object to a stream, one entry per line in the order of
+/// the keys, formatting each entry in place instead of building a json document first.
+/// @param out
+/// @return total number of positions written
+std::uint64_t write_json(std::ostream &out) {
+    const auto records     = sorted_records();
+    const std::size_t size = records.size() + unpacked_map.size();
+
+    std::uint64_t total_pos = 0;
+
+    if (size == 0) {
+        out << "{}";
+        return total_pos;
+    }
+
+    out << "{\n";
+
+    std::string line;
+
+    auto number = [&line](int value) {
+        std::array<char, 16> digits;
+        line.append(digits.data(), std::to_chars(digits.begin(), digits.end(), value).ptr);
+    };
+
+    auto unpacked = unpacked_map.begin();
+
+    for (std::size_t i = 0, written = 0; written < size; ++written) {
+        Key key   = i < records.size() ? static_cast<Key>(records[i].first) : Key{};
+        int count = 0;
+
+        const auto sort_key = std::make_tuple(char(key.result), key.move, key.material, key.eval);
+
+        // the unpacked keys go in at their place in the order of the keys
+        if (unpacked != unpacked_map.end() && (i == records.size() || unpacked->first < sort_key)) {
+            const auto &[result, move, material, eval] = unpacked->first;
+
+            key   = Key{Result(result), move, material, eval};
+            count = unpacked->second;
+            ++unpacked;
+        } else {
+            count = records[i++].second;
+        }
+
+        // "('D', 1, 78, 35)": 668132
+        line.assign("  \"('");
+        line += static_cast<char>(key.result);
+        line += "', ";
+        number(key.move);
+        line += ", ";
+        number(key.material);
+        line += ", ";
+        number(key.eval);
+        line += ")\": ";
+        number(count);
+        line += written + 1 < size ? ",\n" : "\n";
+
+        out.write(line.data(), line.size());
+        total_pos += count;
+    }
+
+    out << "}";
+
+    return total_pos;
+}
+
+/// @brief Save the position map to a json file, gzip compressed if the file name ends in .gz.
+/// @param json_filename
+void save_json(const std::string &json_filename) {
+    const std::string_view gzip_ext = ".gz";
+
+    const bool compress =
+        json_filename.size() >= gzip_ext.size() &&
+        json_filename.compare(json_filename.size() - gzip_ext.size(), gzip_ext.size(), gzip_ext) ==
+            0;
+
+    std::uint64_t total_pos = 0;
+    bool ok                 = false;
+
+    if (compress) {
+        GzipOutputStream out_file(json_filename);
+        total_pos = write_json(out_file);
+        out_file.close();
+        ok = bool(out_file);
+    } else {
+        std::ofstream out_file(json_filename);
+        total_pos = write_json(out_file);
+        out_file.close();
+        ok = bool(out_file);
+    }
+
+    if (!ok) {
+        std::cout << "Error: Failed to write " << json_filename << std::endl;
+        std::exit(1);
+    }
+
     std::cout << "Wrote " << total_pos << " scored positions from " << total_games << " games to "
               << json_filename << " for analysis." << std::endl;
 }
 
+/// @brief Save the position map, in binary if the file name ends in .wdlbin and as json otherwise.
+/// @param filename
+/// @param bin_width
+void save(const std::string &filename, int bin_width) {
+    if (ends_with(filename, ".wdlbin")) {
+        save_binary(filename, bin_width);
+    } else {
+        save_json(filename);
+    }
+}
+
+/// @brief Read a little-endian unsigned integer from a byte buffer.
+/// @tparam T
+/// @param data
+/// @return
+template <typename T>
+T get_le(const char *data) {
+    T value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) value |= T(std::uint8_t(data[i])) << (8 * i);
+    return value;
+}
+
+/// @brief Add the positions and games of a .wdlbin file written by save_binary() to the position
+/// map.
+/// @param filename
+/// @return the bin width of the file
+int load_binary(const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    std::array<char, 56> header;
+
+    in.read(header.data(), header.size());
+
+    if (!in || std::string_view(header.data(), 8) != "WDLBIN01") {
+        std::cout << "Error: " << filename << " is not a .wdlbin file" << std::endl;
+        std::exit(1);
+    }
+
+    const auto header_size = get_le<std::uint32_t>(header.data() + 8);
+    const auto bin_width   = get_le<std::uint32_t>(header.data() + 12);
+    const auto count       = get_le<std::uint64_t>(header.data() + 16);
+    const auto stat        = binaryio::stat(filename);
+
+    // a truncated file, or a corrupt count that must not be allocated
+    if (!stat || header_size < header.size() || header_size > stat->first ||
+        (stat->first - header_size) % 8 != 0 || (stat->first - header_size) / 8 != count) {
+        std::cout << "Error: The size of " << filename << " does not match its header"
+                  << std::endl;
+        std::exit(1);
+    }
+
+    // the records are always written with the layout of PackedKey
+    std::string records(8 * count, '\0');
+    in.seekg(header_size);
+    in.read(records.data(), records.size());
+
+    if (!in) {
+        std::cout << "Error: Failed to read " << filename << std::endl;
+        std::exit(1);
+    }
+
+    for (std::size_t i = 0; i < records.size(); i += 8) {
+        PackedKey key;
+        key.value = get_le<std::uint32_t>(records.data() + i);
+        pos_map[key] += int(get_le<std::uint32_t>(records.data() + i + 4));
+    }
+
+    total_games += get_le<std::uint64_t>(header.data() + 32);
+
+    return int(bin_width);
+}
+
+/// @brief Add the positions of a json(.gz) file written by save_json() to the position map. The
+/// json files do not record the number of games.
+/// @param filename
+void load_json(const std::string &filename) {
+    std::unique_ptr<std::istream> in;
+
+    if (ends_with(filename, ".gz")) {
+        in = std::make_unique<GzipInputStream>(filename);
+    } else {
+        in = std::make_unique<std::ifstream>(filename);
+    }
+
+    const json j = json::parse(*in, nullptr, false);
+
+    if (!*in || j.is_discarded() || !j.is_object()) {
+        std::cout << "Error: Failed to read " << filename << std::endl;
+        std::exit(1);
+    }
+
+    for (const auto &[entry, count] : j.items()) {
+        Key key;
+        char result = 0;
+
+        if (std::sscanf(entry.c_str(), "('%c', %d, %d, %d)", &result, &key.move, &key.material,
+                        &key.eval) != 4 ||
+            (result != 'W' && result != 'D' && result != 'L')) {
+            std::cout << "Error: Unexpected key " << entry << " in " << filename << std::endl;
+            std::exit(1);
+        }
+
+        key.result = Result(result);
+
+        if (PackedKey::fits(key)) {
+            pos_map[PackedKey(key)] += count.get<int>();
+        } else {
+            count_unpacked(key, count.get<int>());
+        }
+    }
+}
+
+/// @brief Sum the outputs of several runs into the position map, without parsing any pgns.
+/// @param filenames .wdlbin or json(.gz) files
+/// @param bin_width used if none of the files records its bin width
+/// @return the bin width of the merged data
+int merge_outputs(const std::vector<std::string> &filenames, int bin_width) {
+    std::optional<int> merged_bin_width;
+    std::size_t json_files = 0;
+
+    for (const auto &filename : filenames) {
+        std::cout << "Merging " << filename << std::endl;
+
+        if (!ends_with(filename, ".wdlbin")) {
+            load_json(filename);
+            json_files++;
+            continue;
+        }
+
+        const int file_bin_width = load_binary(filename);
+
+        if (merged_bin_width && *merged_bin_width != file_bin_width) {
+            std::cout << "Error: Cannot merge files with bin widths " << *merged_bin_width
+                      << " and " << file_bin_width << std::endl;
+            std::exit(1);
+        }
+
+        merged_bin_width = file_bin_width;
+    }
+
+    if (json_files > 0) {
+        std::cout << "Warning: json files do not record the number of games, the total only "
+                     "counts the games of .wdlbin files."
+                  << std::endl;
+    }
+
+    return merged_bin_width.value_or(bin_width);
+}
+
 void print_usage(char const *program_name) {
     std::stringstream ss;
 
@@ -597,7 +1947,8 @@ void print_usage(char const *program_name) {
     ss << "  --allowDuplicates     Allow duplicate directories for test pgns" << "\n";
     ss << "  --concurrency <N>     Number of concurrent threads to use (default: maximum)" << "\n";
     ss << "  --matchRev <regex>    Filter data based on revision SHA in metadata" << "\n";
-    ss << "  --matchEngine <regex> Filter data based on engine name in pgns, defaults to matchRev if given" << "\n";
+    ss << "  --matchRevFile <path> Filter data based on revision SHA in metadata, keeping tests with a SHA listed in this file (like --matchRev .*sha1|.*sha2|...)" << "\n";
+    ss << "  --matchEngine <regex> Filter data based on engine name in pgns, defaults to matchRev or matchRevFile if given" << "\n";
     ss << "  --matchTC <regex>     Filter data based on time control in metadata" << "\n";
     ss << "  --matchThreads <N>    Filter data based on used threads in metadata" << "\n";
     ss << "  --matchBook <regex>   Filter data based on book name in metadata" << "\n";
@@ -605,9 +1956,25 @@ void print_usage(char const *program_name) {
     ss << "  --EloDiffMax <X>      Filter data based on estimated nElo difference" << "\n";
     ss << "  --EloDiffMin <Y>      Filter data based on estimated nElo difference (defaults to -X if X is given)" << "\n";
     ss << "  --SPRTonly            Analyse only pgns from SPRT tests" << "\n";
+    ss << "  --where <expr>        Filter data based on an expression over the metadata, e.g. 'tc~\"60\\+0.6\" && threads==1 && |nElo|<=5'," << "\n";
+    ss << "                        with the fields book, tc, new_tc, resolved_base, resolved_new (==, !=, ~ for regex), threads, nElo, |nElo| (==, !=, <, <=, >, >=) and sprt" << "\n";
     ss << "  --fixFENsource        Patch move counters lost by cutechess-cli based on FENs in this file" << "\n";
+    ss << "  --buildFixFENIndex    Index the --fixFENsource once, stored next to it, and exit. Later runs map the index instead of parsing the FENs" << "\n";
     ss << "  --binWidth            bin position scores for faster processing and smoother densities (default 5)" << "\n";
-    ss << "  -o <path>             Path to output json file (default: scoreWDLstat.json)" << "\n";
+    ss << "  --moveMax <N>         Count only positions up to move N, e.g. for material-only analyses (default 200)" << "\n";
+    ss << "  --blockSize <N>       Read and inflate .pgn(.gz) files in blocks of N MiB (default " << analysis::default_block_size << ")" << "\n";
+    ss << "  --splitSize <N>       Split .pgn files larger than N MiB at game boundaries and analyse the parts in parallel (default: 0, no splitting)" << "\n";
+    ss << "  --aggregation <mode>  Count positions in a map per thread, merged at the end (local), in one shared map (shared)," << "\n";
+    ss << "                        or in dense counters per thread, which need about 80 MB per thread for --binWidth 5 (dense) (default: local)" << "\n";
+    ss << "  --benchAggregation    Compare the throughput of both aggregation modes on the collected positions" << "\n";
+    ss << "  --gzIndex <N>         Index .pgn.gz files with access points every N MiB, stored next to the file, and analyse the parts of indexed files in parallel (default: 0, no index)" << "\n";
+    ss << "  --shard <i/N>         Analyse only the files of shard i (0 <= i < N), with the tests distributed over N shards by a hash of their id" << "\n";
+    ss << "  --merge <files>       Sum the outputs (.wdlbin or json(.gz)) of several runs, e.g. of all shards, into the file given by -o" << "\n";
+    ss << "  --manifest <path>     Keep the listing of every directory in this file, and only list directories modified since in later runs" << "\n";
+    ss << "  --metaIndex <path>    Keep the metadata of all tests in this file, and only parse the jsons of new or modified tests in later runs" << "\n";
+    ss << "  --cacheDir <path>     Cache the positions counted in each file in this directory, and reuse them for unchanged files in later runs with the same options" << "\n";
+    ss << "  --verifySan           Check every SAN move resolved by the fast resolver against the legal moves of the position" << "\n";
+    ss << "  -o <path>             Path to output json file, compressed if it ends in .gz, or binary file if it ends in .wdlbin (default: scoreWDLstat.json)" << "\n";
     ss << "  --help                Print this help message" << "\n";
     // clang-format on
 
@@ -636,9 +2003,7 @@ int main(int argc, char const *argv[]) {
     std::vector<std::string> files_pgn;
     std::string json_filename = "scoreWDLstat.json";
     std::string default_path  = "./pgns";
-    std::string regex_engine;
-    map_fens fixfen_map;
-    int bin_width   = 5;
+    analysis::Options options;
     int concurrency = std::max(1, int(std::thread::hardware_concurrency()));
 
     if (cmd.has_argument("--help", true)) {
@@ -647,13 +2012,90 @@ int main(int argc, char const *argv[]) {
     }
 
     if (cmd.has_argument("--binWidth")) {
-        bin_width = std::stoi(cmd.get_argument("--binWidth"));
+        options.bin_width = std::stoi(cmd.get_argument("--binWidth"));
+
+        // the largest binned eval must fit into the 11 bits of a PackedKey
+        if (options.bin_width < 1 ||
+            int(std::round(1000.0f / options.bin_width)) * options.bin_width > 1023) {
+            std::cout << "Error: --binWidth must be positive and bin the eval 1000 to at most 1023"
+                      << std::endl;
+            std::exit(1);
+        }
+    }
+
+    if (cmd.has_argument("--moveMax")) {
+        options.move_max = std::stoi(cmd.get_argument("--moveMax"));
+
+        if (options.move_max < 1 || options.move_max > DenseCounts::max_move) {
+            std::cout << "Error: --moveMax must be in [1, " << DenseCounts::max_move
+                      << "]" << std::endl;
+            std::exit(1);
+        }
+    }
+
+    if (cmd.has_argument("--blockSize")) {
+        options.block_size = std::size_t(std::max(1, std::stoi(cmd.get_argument("--blockSize"))))
+                             << 20;
+    }
+
+    if (cmd.has_argument("--splitSize")) {
+        options.split_size = std::size_t(std::max(0, std::stoi(cmd.get_argument("--splitSize"))))
+                             << 20;
+    }
+
+    if (cmd.has_argument("--gzIndex")) {
+        options.index_span = std::size_t(std::max(0, std::stoi(cmd.get_argument("--gzIndex"))))
+                             << 20;
+    }
+
+    if (cmd.has_argument("--aggregation")) {
+        const auto mode = cmd.get_argument("--aggregation");
+
+        if (mode == "shared") {
+            options.aggregation = analysis::Aggregation::SHARED;
+        } else if (mode == "dense") {
+            options.aggregation = analysis::Aggregation::DENSE;
+        } else if (mode != "local") {
+            std::cout << "Error: Unknown aggregation mode " << mode << std::endl;
+            std::exit(1);
+        }
+    }
+
+    if (cmd.has_argument("--verifySan", true)) {
+        options.verify_san = true;
     }
 
     if (cmd.has_argument("--concurrency")) {
         concurrency = std::stoi(cmd.get_argument("--concurrency"));
     }
 
+    if (cmd.has_argument("--merge")) {
+        const auto bin_width = merge_outputs(cmd.get_arguments("--merge"), options.bin_width);
+        save(cmd.get_argument("-o", json_filename), bin_width);
+        return 0;
+    }
+
+    if (cmd.has_argument("--buildFixFENIndex", true)) {
+        const auto source = cmd.get_argument("--fixFENsource");
+
+        if (source.empty()) {
+            std::cout << "Error: --buildFixFENIndex needs the --fixFENsource to index" << std::endl;
+            std::exit(1);
+        }
+
+        const auto count = fixfenindex::Index::build(source);
+
+        if (!count) {
+            std::cout << "Error: Failed to write " << fixfenindex::Index::sidecar(source)
+                      << std::endl;
+            std::exit(1);
+        }
+
+        std::cout << "Wrote the index of " << *count << " FENs to "
+                  << fixfenindex::Index::sidecar(source) << std::endl;
+        return 0;
+    }
+
     if (cmd.has_argument("--file")) {
         files_pgn = {cmd.get_argument("--file")};
     } else {
@@ -663,7 +2105,29 @@ int main(int argc, char const *argv[]) {
         std::cout << "Looking " << (recursive ? "(recursively) " : "") << "for pgn files in "
                   << path << std::endl;
 
-        files_pgn = get_files(path, recursive);
+        std::optional<crawler::Manifest> manifest;
+
+        if (cmd.has_argument("--manifest")) {
+            manifest.emplace(cmd.get_argument("--manifest"));
+        }
+
+        auto crawl = crawler::crawl(path, recursive, concurrency, manifest ? &*manifest : nullptr);
+
+        if (!crawl.errors.empty()) {
+            for (const auto &[directory, ec] : crawl.errors) {
+                std::cout << "Error: Failed to list " << directory << ": " << ec.message()
+                          << std::endl;
+            }
+
+            std::exit(1);
+        }
+
+        if (manifest && !manifest->save()) {
+            std::cout << "Warning: Failed to write the file manifest "
+                      << cmd.get_argument("--manifest") << std::endl;
+        }
+
+        files_pgn = std::move(crawl.files);
 
         // sort to easily check for "duplicate" files, i.e. "foo.pgn.gz" and "foo.pgn"
         std::sort(files_pgn.begin(), files_pgn.end());
@@ -679,10 +2143,33 @@ int main(int argc, char const *argv[]) {
 
     std::cout << "Found " << files_pgn.size() << " .pgn(.gz) files in total." << std::endl;
 
-    auto meta_map = get_metadata(files_pgn, cmd.has_argument("--allowDuplicates", true));
+    check_duplicate_tests(files_pgn, cmd.has_argument("--allowDuplicates", true));
+
+    if (cmd.has_argument("--shard")) {
+        const auto shard = cmd.get_argument("--shard");
+        unsigned long long index = 0, count = 0;
+        char end                 = 0;
+
+        if (std::sscanf(shard.c_str(), "%llu/%llu%c", &index, &count, &end) != 2 ||
+            index >= count) {
+            std::cout << "Error: Invalid shard " << shard << ", expected i/N with 0 <= i < N"
+                      << std::endl;
+            std::exit(1);
+        }
+
+        FilterStage shard_filter;
+        shard_filter.add(ShardFilterStrategy(index, count));
+        shard_filter.apply(files_pgn, map_meta());
+
+        std::cout << "Keeping " << files_pgn.size() << " pgn files of shard " << shard
+                  << std::endl;
+    }
+
+    // all filters are evaluated together in a single pass, once per test
+    FilterStage filters;
 
     if (cmd.has_argument("--SPRTonly", true)) {
-        filter_files(files_pgn, meta_map, SprtFilterStrategy());
+        filters.add(SprtFilterStrategy());
     }
 
     if (cmd.has_argument("--matchBook")) {
@@ -692,7 +2179,7 @@ int main(int argc, char const *argv[]) {
             bool invert = cmd.has_argument("--matchBookInvert", true);
             std::cout << "Filtering pgn files " << (invert ? "not " : "")
                       << "matching the book name " << regex_book << std::endl;
-            filter_files(files_pgn, meta_map, BookFilterStrategy(std::regex(regex_book), invert));
+            filters.add(BookFilterStrategy(std::regex(regex_book), invert));
         }
     }
 
@@ -701,10 +2188,31 @@ int main(int argc, char const *argv[]) {
 
         if (!regex_rev.empty()) {
             std::cout << "Filtering pgn files matching revision SHA " << regex_rev << std::endl;
-            filter_files(files_pgn, meta_map, RevFilterStrategy(std::regex(regex_rev)));
+            filters.add(RevFilterStrategy(std::regex(regex_rev)));
+        }
+
+        options.regex_engine = regex_rev;
+    }
+
+    if (cmd.has_argument("--matchRevFile")) {
+        const auto rev_file = cmd.get_argument("--matchRevFile");
+        std::ifstream revs(rev_file);
+
+        if (!revs) {
+            std::cout << "Error: Could not open " << rev_file << std::endl;
+            std::exit(1);
+        }
+
+        if (cmd.has_argument("--matchRev")) {
+            std::cout << "Error: Use either --matchRev or --matchRevFile" << std::endl;
+            std::exit(1);
         }
 
-        regex_engine = regex_rev;
+        options.engine_revs.read(revs);
+
+        std::cout << "Filtering pgn files matching one of the " << options.engine_revs.size()
+                  << " revision SHAs in " << rev_file << std::endl;
+        filters.add(RevFilterStrategy(options.engine_revs));
     }
 
     if (cmd.has_argument("--matchTC")) {
@@ -712,7 +2220,7 @@ int main(int argc, char const *argv[]) {
 
         if (!regex_tc.empty()) {
             std::cout << "Filtering pgn files matching TC " << regex_tc << std::endl;
-            filter_files(files_pgn, meta_map, TcFilterStrategy(std::regex(regex_tc)));
+            filters.add(TcFilterStrategy(std::regex(regex_tc)));
         }
     }
 
@@ -720,7 +2228,7 @@ int main(int argc, char const *argv[]) {
         int threads = std::stoi(cmd.get_argument("--matchThreads"));
 
         std::cout << "Filtering pgn files using threads = " << threads << std::endl;
-        filter_files(files_pgn, meta_map, ThreadsFilterStrategy(threads));
+        filters.add(ThreadsFilterStrategy(threads));
     }
 
     if (cmd.has_argument("--EloDiffMax") || cmd.has_argument("--EloDiffMin")) {
@@ -739,15 +2247,54 @@ int main(int argc, char const *argv[]) {
                       << std::endl;
         }
 
-        filter_files(files_pgn, meta_map, EloFilterStrategy(mi, ma));
+        filters.add(EloFilterStrategy(mi, ma));
+    }
+
+    if (cmd.has_argument("--where")) {
+        const auto expression = cmd.get_argument("--where");
+
+        std::cout << "Filtering pgn files where " << expression << std::endl;
+        filters.add(WhereFilterStrategy(expression));
+    }
+
+    // the metadata of the remaining files is only loaded if a filter needs it
+    if (!filters.empty()) {
+        map_meta meta_map;
+
+        if (cmd.has_argument("--metaIndex")) {
+            const auto index_file = cmd.get_argument("--metaIndex");
+            metaindex::Index index(index_file);
+
+            meta_map = get_metadata(files_pgn, concurrency, &index);
+
+            if (!index.save()) {
+                std::cout << "Warning: Failed to write the metadata index " << index_file
+                          << std::endl;
+            }
+        } else {
+            meta_map = get_metadata(files_pgn, concurrency);
+        }
+
+        filters.apply(files_pgn, meta_map);
     }
 
     if (cmd.has_argument("--fixFENsource")) {
-        fixfen_map = get_fixfen(cmd.get_argument("--fixFENsource"));
+        options.fixfen_source = cmd.get_argument("--fixFENsource");
+
+        if (!options.fixfen.open(options.fixfen_source)) {
+            std::cout << "Read " << options.fixfen.size() << " FENs from " << options.fixfen_source
+                      << ", index them once with --buildFixFENIndex for faster startup"
+                      << std::endl;
+        }
+    }
+
+    if (cmd.has_argument("--cacheDir")) {
+        options.cache_dir = cmd.get_argument("--cacheDir");
     }
 
     if (cmd.has_argument("--matchEngine")) {
-        regex_engine = cmd.get_argument("--matchEngine");
+        options.regex_engine = cmd.get_argument("--matchEngine");
+        options.engine_revs  = RevisionSet();
     }
 
     if (cmd.has_argument("-o")) {
@@ -755,14 +2302,18 @@ int main(int argc, char const *argv[]) {
     }
 
     const auto t0 = std::chrono::high_resolution_clock::now();
-    process(files_pgn, regex_engine, fixfen_map, concurrency, bin_width);
+    process(files_pgn, options, concurrency);
     const auto t1 = std::chrono::high_resolution_clock::now();
 
     std::cout << "\nTime taken: "
               << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() / 1000.0
               << "s" << std::endl;
 
-    save(json_filename);
+    if (cmd.has_argument("--benchAggregation", true)) {
+        bench_aggregation(concurrency);
+    }
+
+    save(json_filename, options.bin_width);
 
     return 0;
 }
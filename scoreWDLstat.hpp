@@ -1,13 +1,34 @@
+#pragma once
+
 #include <zlib.h>
 
 #include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <istream>
 #include <optional>
+#include <ostream>
+#include <streambuf>
 #include <string>
 #include <string_view>
+#include <unordered_set>
 #include <vector>
 
+#if defined(__unix__) || defined(__unix) || defined(unix) || defined(__APPLE__) || defined(__MACH__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define WDL_USE_MMAP 1
+#else
+#include <fstream>
+#endif
+
 #include "external/json.hpp"
 
 enum class Result { WIN = 'W', DRAW = 'D', LOSS = 'L' };
@@ -23,30 +44,173 @@ struct Key {
     bool operator==(const Key &k) const {
         return result == k.result && move == k.move && material == k.material && eval == k.eval;
     }
-    operator std::size_t() const {
-        // golden ratio hashing, thus 0x9e3779b9
-        std::uint32_t hash = static_cast<int>(result);
-        hash ^= move + 0x9e3779b9 + (hash << 6) + (hash >> 2);
-        hash ^= material + 0x9e3779b9 + (hash << 6) + (hash >> 2);
-        hash ^= eval + 0x9e3779b9 + (hash << 6) + (hash >> 2);
-        return hash;
-    }
     operator std::string() const {
         return "('" + std::string(1, static_cast<char>(result)) + "', " + std::to_string(move) +
                ", " + std::to_string(material) + ", " + std::to_string(eval) + ")";
     }
 };
 
-// overload the std::hash function for Key
-template <>
-struct std::hash<Key> {
-    std::size_t operator()(const Key &k) const { return static_cast<std::size_t>(k); }
+/// @brief Key packed into 32 bits: 2 bits result, 8 bits move, 8 bits material and 11 bits eval
+/// (offset by 1024), from most to least significant. The packed values sort like the
+/// (result, move, material, eval) tuples and are their own collision-free hash. Keys outside of
+/// these ranges cannot be packed, see fits().
+struct PackedKey {
+    std::uint32_t value = 0;
+
+    PackedKey() = default;
+
+    explicit PackedKey(const Key &key) {
+        // results in the order of their characters, D < L < W
+        const std::uint32_t result = key.result == Result::DRAW ? 0
+                                     : key.result == Result::LOSS ? 1
+                                                                  : 2;
+
+        assert(fits(key));
+
+        value = result << 27 | std::uint32_t(key.move) << 19 | std::uint32_t(key.material) << 11 |
+                std::uint32_t(key.eval + 1024);
+    }
+
+    explicit operator Key() const {
+        static constexpr Result results[] = {Result::DRAW, Result::LOSS, Result::WIN};
+
+        Key key;
+        key.result   = results[value >> 27];
+        key.move     = (value >> 19) & 0xff;
+        key.material = (value >> 11) & 0xff;
+        key.eval     = int(value & 0x7ff) - 1024;
+
+        return key;
+    }
+
+    /// @brief Check if the fields of a key fit into their bits.
+    /// @param key
+    /// @return
+    [[nodiscard]] static bool fits(const Key &key) {
+        return 0 <= key.move && key.move < 256 && 0 <= key.material && key.material < 256 &&
+               -1024 <= key.eval && key.eval < 1024;
+    }
+
+    bool operator==(const PackedKey &k) const { return value == k.value; }
+    bool operator<(const PackedKey &k) const { return value < k.value; }
 };
 
-// overload the std::equal_to function for Key
+// the packed key is a perfect hash
 template <>
-struct std::equal_to<Key> {
-    bool operator()(const Key &lhs, const Key &rhs) const { return lhs == rhs; }
+struct std::hash<PackedKey> {
+    std::size_t operator()(const PackedKey &k) const { return k.value; }
+};
+
+/// @brief Dense array of counters for all keys in the bounded domain produced by the analysis:
+/// 3 results, moves up to 200, material up to 78 and evals in [-1000, 1000] binned with the given
+/// bin width, plus -1001 and 1001 for mates. Counting a key is a plain indexed increment.
+class DenseCounts {
+   public:
+    static constexpr int max_move     = 200;
+    static constexpr int max_material = 78;
+
+    explicit DenseCounts(int bin_width)
+        : bin_width(bin_width),
+          max_bin(int(std::round(1000.0f / bin_width))),
+          eval_slots(2 * max_bin + 3),
+          counts(std::size_t(3) * (max_move + 1) * (max_material + 1) * eval_slots) {}
+
+    /// @brief Count the key, if it is inside the dense domain.
+    /// @param key
+    /// @return false if the key has to be counted elsewhere
+    bool add(const Key &key) {
+        const auto idx = index(key);
+
+        if (idx == npos) {
+            return false;
+        }
+
+        counts[idx]++;
+        return true;
+    }
+
+    /// @brief Add the counters of other in [begin, end) to this one.
+    void add(const DenseCounts &other, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            counts[i] += other.counts[i];
+        }
+    }
+
+    std::size_t size() const { return counts.size(); }
+
+    /// @brief Call f(key, count) for all keys with a non-zero count.
+    template <typename FUNC>
+    void for_each(FUNC f) const {
+        static constexpr Result results[] = {Result::WIN, Result::DRAW, Result::LOSS};
+
+        for (std::size_t i = 0; i < counts.size(); i++) {
+            if (counts[i] == 0) {
+                continue;
+            }
+
+            std::size_t rest = i;
+            const int slot   = rest % eval_slots;
+            rest /= eval_slots;
+
+            Key key;
+            key.material = rest % (max_material + 1);
+            rest /= max_material + 1;
+            key.move   = rest % (max_move + 1);
+            key.result = results[rest / (max_move + 1)];
+            key.eval   = slot == 0                ? -1001
+                         : slot == eval_slots - 1 ? 1001
+                                                  : (slot - max_bin - 1) * bin_width;
+
+            f(key, counts[i]);
+        }
+    }
+
+   private:
+    static constexpr std::size_t npos = std::size_t(-1);
+
+    std::size_t index(const Key &key) const {
+        if (key.move < 0 || key.move > max_move || key.material < 0 ||
+            key.material > max_material) {
+            return npos;
+        }
+
+        int slot;
+
+        if (key.eval == -1001) {
+            slot = 0;
+        } else if (key.eval == 1001) {
+            slot = eval_slots - 1;
+        } else if (key.eval % bin_width == 0 && std::abs(key.eval / bin_width) <= max_bin) {
+            slot = key.eval / bin_width + max_bin + 1;
+        } else {
+            return npos;
+        }
+
+        int result;
+
+        switch (key.result) {
+            case Result::WIN:
+                result = 0;
+                break;
+            case Result::DRAW:
+                result = 1;
+                break;
+            case Result::LOSS:
+                result = 2;
+                break;
+            default:
+                return npos;
+        }
+
+        const std::size_t row = std::size_t(result) * (max_move + 1) + key.move;
+
+        return (row * (max_material + 1) + key.material) * eval_slots + slot;
+    }
+
+    const int bin_width;
+    const int max_bin;
+    const int eval_slots;
+    std::vector<std::uint32_t> counts;
 };
 
 struct TestMetaData {
@@ -56,31 +220,130 @@ struct TestMetaData {
     std::optional<std::vector<int>> pentanomial;
 };
 
-template <typename T = std::string>
-std::optional<T> get_optional(const nlohmann::json &j, const char *name) {
-    const auto it = j.find(name);
-    if (it != j.end()) {
-        return std::optional<T>(j[name]);
-    } else {
-        return std::nullopt;
+/// @brief SAX handler that extracts the TestMetaData from a fishtest test's json, only looking at
+/// the fields of the "args" and "results" objects and stopping once both have been read, such
+/// that the large "tasks" array of the test is usually never parsed.
+class TestMetaDataReader : public nlohmann::json_sax<nlohmann::json> {
+   public:
+    /// @brief Read the metadata from a stream.
+    /// @param in
+    /// @return nothing if the json is invalid
+    static std::optional<TestMetaData> read(std::istream &in) {
+        TestMetaDataReader reader;
+
+        nlohmann::json::sax_parse(in, &reader);
+
+        if (reader.failed) {
+            return std::nullopt;
+        }
+
+        return reader.meta;
     }
-}
 
-void from_json(const nlohmann::json &nlohmann_json_j, TestMetaData &nlohmann_json_t) {
-    auto &j = nlohmann_json_j["args"];
+    bool null() override { return true; }
 
-    nlohmann_json_t.sprt = j.contains("sprt") ? std::optional<bool>(true) : std::nullopt;
+    bool boolean(bool) override { return true; }
 
-    nlohmann_json_t.book          = get_optional(j, "book");
-    nlohmann_json_t.new_tc        = get_optional(j, "new_tc");
-    nlohmann_json_t.resolved_base = get_optional(j, "resolved_base");
-    nlohmann_json_t.resolved_new  = get_optional(j, "resolved_new");
-    nlohmann_json_t.tc            = get_optional(j, "tc");
-    nlohmann_json_t.threads       = get_optional<int>(j, "threads");
+    bool number_integer(number_integer_t val) override { return number(val); }
 
-    auto &jr                    = nlohmann_json_j["results"];
-    nlohmann_json_t.pentanomial = get_optional<std::vector<int>>(jr, "pentanomial");
-}
+    bool number_unsigned(number_unsigned_t val) override { return number(val); }
+
+    bool number_float(number_float_t val, const string_t &) override { return number(val); }
+
+    bool string(string_t &val) override {
+        if (depth == 2 && section == Section::ARGS) {
+            if (field == "book") {
+                meta.book = std::move(val);
+            } else if (field == "new_tc") {
+                meta.new_tc = std::move(val);
+            } else if (field == "resolved_base") {
+                meta.resolved_base = std::move(val);
+            } else if (field == "resolved_new") {
+                meta.resolved_new = std::move(val);
+            } else if (field == "tc") {
+                meta.tc = std::move(val);
+            }
+        }
+
+        return true;
+    }
+
+    bool binary(binary_t &) override { return true; }
+
+    bool start_object(std::size_t) override {
+        depth++;
+        return true;
+    }
+
+    bool key(string_t &val) override {
+        if (depth == 1) {
+            section = val == "args"      ? Section::ARGS
+                      : val == "results" ? Section::RESULTS
+                                         : Section::OTHER;
+        } else if (depth == 2) {
+            field = std::move(val);
+
+            if (section == Section::ARGS && field == "sprt") {
+                meta.sprt = true;
+            }
+        }
+
+        return true;
+    }
+
+    bool end_object() override { return end_container(); }
+
+    bool start_array(std::size_t) override {
+        depth++;
+
+        if (depth == 3 && section == Section::RESULTS && field == "pentanomial") {
+            meta.pentanomial.emplace();
+        }
+
+        return true;
+    }
+
+    bool end_array() override { return end_container(); }
+
+    bool parse_error(std::size_t, const std::string &,
+                     const nlohmann::detail::exception &) override {
+        failed = true;
+        return false;
+    }
+
+   private:
+    enum class Section { OTHER, ARGS, RESULTS };
+
+    TestMetaData meta;
+    int depth       = 0;
+    Section section = Section::OTHER;
+    std::string field;
+    bool read_args    = false;
+    bool read_results = false;
+    bool failed       = false;
+
+    template <typename T>
+    bool number(T val) {
+        if (depth == 2 && section == Section::ARGS && field == "threads") {
+            meta.threads = int(val);
+        } else if (depth == 3 && section == Section::RESULTS && field == "pentanomial") {
+            meta.pentanomial->push_back(int(val));
+        }
+
+        return true;
+    }
+
+    bool end_container() {
+        if (--depth == 1) {
+            read_args    = read_args || section == Section::ARGS;
+            read_results = read_results || section == Section::RESULTS;
+            section      = Section::OTHER;
+        }
+
+        // all fields are known, stop parsing
+        return !(read_args && read_results);
+    }
+};
 
 /// @brief Custom stof implementation to avoid locale issues, once clang supports std::from_chars
 /// for floats this can be removed
@@ -126,57 +389,499 @@ inline float fast_stof(const char *str) {
     return result;
 }
 
-/// @brief Get all files from a directory.
-/// @param path
-/// @param recursive
+/// @brief Layout of the comments engines write after their moves, fishtest writes
+/// Nf3 {+0.57/17 0.594s}, openbench Nf3 {+0.57 17/28 583 363004}
+enum class EvalFormat { UNKNOWN, FISHTEST, OPENBENCH };
+
+/// @brief Parsed eval of a comment without an eval
+constexpr int NO_EVAL = 1002;
+/// @brief Parsed eval of a comment with a mate score for the side to move
+constexpr int MATE_EVAL = 1001;
+
+/// @brief Parse the eval at the start of a move comment in any format.
+/// @param comment
+/// @return centipawns clamped to [-1000, 1000], +-MATE_EVAL for mate scores or NO_EVAL
+inline int parse_eval_generic(std::string_view comment) {
+    const size_t delimiter_pos = comment.find_first_of(" /");
+
+    if (delimiter_pos == std::string::npos || comment == "book") {
+        return NO_EVAL;
+    }
+
+    const auto match_eval = comment.substr(0, delimiter_pos);
+
+    if (match_eval[1] == 'M') {
+        return match_eval[0] == '+' ? MATE_EVAL : -MATE_EVAL;
+    }
+
+    const int eval = 100 * fast_stof(match_eval.data());
+
+    return std::clamp(eval, -1000, 1000);
+}
+
+/// @brief Detect the format of the move comments from a comment with an eval.
+/// @param comment
 /// @return
-[[nodiscard]] inline std::vector<std::string> get_files(const std::string &path,
-                                                        bool recursive = false) {
-    std::vector<std::string> files;
-
-    for (const auto &entry : std::filesystem::directory_iterator(path)) {
-        if (std::filesystem::is_regular_file(entry)) {
-            std::string stem      = entry.path().stem().string();
-            std::string extension = entry.path().extension().string();
-            if (extension == ".gz") {
-                if (stem.size() >= 4 && stem.substr(stem.size() - 4) == ".pgn") {
-                    files.push_back(entry.path().string());
-                }
-            } else if (extension == ".pgn") {
-                files.push_back(entry.path().string());
+inline EvalFormat sniff_eval_format(std::string_view comment) {
+    const size_t delimiter_pos = comment.find_first_of(" /");
+
+    if (delimiter_pos == std::string::npos || comment == "book") {
+        return EvalFormat::UNKNOWN;
+    }
+
+    return comment[delimiter_pos] == '/' ? EvalFormat::FISHTEST : EvalFormat::OPENBENCH;
+}
+
+/// @brief Parse the eval at the start of a move comment written in a known format. The digits
+/// are read in a single pass as an integer, the comment is neither searched for the delimiter
+/// first nor scanned again, and anything unexpected is left to parse_eval_generic. The final
+/// scaling to centipawns repeats the float arithmetic of fast_stof, such that the counted evals
+/// do not change.
+/// @tparam format
+/// @param comment
+/// @return centipawns clamped to [-1000, 1000], +-MATE_EVAL for mate scores or NO_EVAL
+template <EvalFormat format>
+inline int parse_eval(std::string_view comment) {
+    if constexpr (format == EvalFormat::UNKNOWN) {
+        return parse_eval_generic(comment);
+    } else {
+        constexpr char delimiter     = format == EvalFormat::FISHTEST ? '/' : ' ';
+        constexpr float fractions[8] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f};
+
+        const char *p   = comment.data();
+        const char *end = p + comment.size();
+
+        const bool negative = p != end && *p == '-';
+
+        if (p != end && (*p == '-' || *p == '+')) {
+            p++;
+        }
+
+        const char *const number = p;
+        std::uint32_t digits     = 0;
+        int decimals             = 0;
+
+        while (p != end && *p >= '0' && *p <= '9') {
+            digits = digits * 10 + (*p++ - '0');
+        }
+
+        if (p != end && *p == '.') {
+            p++;
+
+            while (p != end && *p >= '0' && *p <= '9') {
+                digits = digits * 10 + (*p++ - '0');
+                decimals++;
             }
-        } else if (recursive && std::filesystem::is_directory(entry)) {
-            auto subdir_files = get_files(entry.path().string(), true);
-            files.insert(files.end(), subdir_files.begin(), subdir_files.end());
         }
+
+        // mate scores, missing or huge numbers and the other format take the slow path, the
+        // digits are exact as float only below 2^24
+        if (p == end || *p != delimiter || p == number || p - number > 8 || decimals > 7 ||
+            digits >= (1u << 24)) {
+            return parse_eval_generic(comment);
+        }
+
+        const float value = (negative ? -float(digits) : float(digits)) / fractions[decimals];
+        const int eval    = 100 * value;
+
+        return std::clamp(eval, -1000, 1000);
     }
+}
 
-    return files;
+/// @brief Check if a string ends with the given suffix.
+/// @param str
+/// @param suffix
+/// @return
+[[nodiscard]] inline bool ends_with(std::string_view str, std::string_view suffix) {
+    return str.size() >= suffix.size() && str.substr(str.size() - suffix.size()) == suffix;
 }
 
-/// @brief Split into successive n-sized chunks from pgns.
-/// @param pgns
-/// @param target_chunks
+/// @brief 64 bit FNV-1a hash of a string, stable across platforms and runs.
+/// @param data
+/// @return
+[[nodiscard]] inline std::uint64_t fnv1a(std::string_view data) {
+    std::uint64_t hash = 14695981039346656037ull;
+
+    for (const char c : data) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+/// @brief Read-only streambuf that inflates a .gz file with zlib. Bulk reads, as done by the pgn
+/// parser, are inflated straight into the caller's buffer with a single gzread call per block,
+/// only single character access (peek/get) goes through the small internal buffer.
+class GzipInputBuffer : public std::streambuf {
+   public:
+    /// @brief Size of zlib's internal buffer for compressed input.
+    static constexpr unsigned int gz_read_size = 128 * 1024;
+
+    explicit GzipInputBuffer(const std::string &filename) {
+        file = gzopen(filename.c_str(), "rb");
+
+        if (file != nullptr) {
+            gzbuffer(file, gz_read_size);
+        }
+    }
+
+    GzipInputBuffer(const GzipInputBuffer &)            = delete;
+    GzipInputBuffer &operator=(const GzipInputBuffer &) = delete;
+
+    ~GzipInputBuffer() override {
+        if (file != nullptr) {
+            gzclose(file);
+        }
+    }
+
+    bool is_open() const { return file != nullptr; }
+
+   protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        if (file == nullptr) {
+            return traits_type::eof();
+        }
+
+        const int n = gzread(file, buffer.data(), buffer.size());
+
+        if (n <= 0) {
+            return traits_type::eof();
+        }
+
+        setg(buffer.data(), buffer.data(), buffer.data() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char *s, std::streamsize count) override {
+        // first hand out what is left from previous single character reads
+        std::streamsize done = std::min<std::streamsize>(egptr() - gptr(), count);
+        std::memcpy(s, gptr(), done);
+        gbump(done);
+
+        while (done < count && file != nullptr) {
+            const auto chunk = std::min<std::streamsize>(count - done, INT32_MAX);
+            const int n      = gzread(file, s + done, static_cast<unsigned int>(chunk));
+
+            if (n <= 0) {
+                break;
+            }
+
+            done += n;
+        }
+
+        return done;
+    }
+
+   private:
+    gzFile file = nullptr;
+    std::array<char, 4096> buffer;
+};
+
+/// @brief std::istream for .gz files, reading through GzipInputBuffer.
+class GzipInputStream : public std::istream {
+   public:
+    explicit GzipInputStream(const std::string &filename) : std::istream(nullptr), buf(filename) {
+        rdbuf(&buf);
+
+        if (!buf.is_open()) {
+            setstate(std::ios::failbit);
+        }
+    }
+
+   private:
+    GzipInputBuffer buf;
+};
+
+/// @brief std::streambuf that compresses everything written to it into a .gz file.
+class GzipOutputBuffer : public std::streambuf {
+   public:
+    explicit GzipOutputBuffer(const std::string &filename) {
+        file = gzopen(filename.c_str(), "wb");
+
+        if (file != nullptr) {
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+    }
+
+    GzipOutputBuffer(const GzipOutputBuffer &)            = delete;
+    GzipOutputBuffer &operator=(const GzipOutputBuffer &) = delete;
+
+    ~GzipOutputBuffer() override { close(); }
+
+    bool is_open() const { return file != nullptr; }
+
+    /// @brief Flush the buffer and finish the .gz file.
+    /// @return false if any write failed
+    bool close() {
+        if (file == nullptr) {
+            return ok;
+        }
+
+        ok = sync() == 0 && ok;
+        ok = gzclose(file) == Z_OK && ok;
+        file = nullptr;
+
+        return ok;
+    }
+
+   protected:
+    int_type overflow(int_type ch) override {
+        if (sync() != 0) {
+            return traits_type::eof();
+        }
+
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        const auto n = pptr() - pbase();
+
+        if (n > 0 && (file == nullptr || gzwrite(file, pbase(), unsigned(n)) != n)) {
+            ok = false;
+            return -1;
+        }
+
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return 0;
+    }
+
+   private:
+    gzFile file = nullptr;
+    bool ok     = true;
+    std::array<char, 64 * 1024> buffer;
+};
+
+/// @brief std::ostream for .gz files, writing through GzipOutputBuffer.
+class GzipOutputStream : public std::ostream {
+   public:
+    explicit GzipOutputStream(const std::string &filename) : std::ostream(nullptr), buf(filename) {
+        rdbuf(&buf);
+
+        if (!buf.is_open()) {
+            setstate(std::ios::failbit);
+        }
+    }
+
+    void close() {
+        if (!buf.close()) {
+            setstate(std::ios::badbit);
+        }
+    }
+
+   private:
+    GzipOutputBuffer buf;
+};
+
+/// @brief Read-only view of a whole file, memory mapped where supported and read into memory
+/// otherwise.
+class MappedFile {
+   public:
+    /// @brief
+    /// @param filename
+    /// @param sequential whether the file is read front to back, rather than at random positions
+    explicit MappedFile(const std::string &filename, bool sequential = true) {
+#ifdef WDL_USE_MMAP
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat st;
+
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr != MAP_FAILED) {
+                ::madvise(addr, st.st_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+                data_ = static_cast<const char *>(addr);
+                size_ = st.st_size;
+            }
+        }
+
+        ::close(fd);
+#else
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+
+        if (!file) {
+            return;
+        }
+
+        buffer_.resize(file.tellg());
+        file.seekg(0);
+        file.read(buffer_.data(), buffer_.size());
+        data_ = buffer_.data();
+        size_ = file.gcount();
+#endif
+    }
+
+    MappedFile(const MappedFile &)            = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+#ifdef WDL_USE_MMAP
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char *>(data_), size_);
+        }
+#endif
+    }
+
+    std::string_view view() const { return {data_, size_}; }
+
+   private:
+    const char *data_ = nullptr;
+    std::size_t size_ = 0;
+#ifndef WDL_USE_MMAP
+    std::vector<char> buffer_;
+#endif
+};
+
+/// @brief Read-only streambuf over a range of memory, e.g. a part of a MappedFile.
+class MemoryInputBuffer : public std::streambuf {
+   public:
+    explicit MemoryInputBuffer(std::string_view data) {
+        char *begin = const_cast<char *>(data.data());
+        setg(begin, begin, begin + data.size());
+    }
+};
+
+/// @brief std::istream over a range of memory.
+class MemoryInputStream : public std::istream {
+   public:
+    explicit MemoryInputStream(std::string_view data) : std::istream(nullptr), buf(data) {
+        rdbuf(&buf);
+    }
+
+   private:
+    MemoryInputBuffer buf;
+};
+
+/// @brief Split pgn data into ranges of roughly target_size bytes, each starting with a game.
+/// @param data
+/// @param target_size
 /// @return
-[[nodiscard]] inline std::vector<std::vector<std::string>> split_chunks(
-    const std::vector<std::string> &pgns, int target_chunks) {
-    const int chunks_size = (pgns.size() + target_chunks - 1) / target_chunks;
+[[nodiscard]] inline std::vector<std::string_view> split_pgn(std::string_view data,
+                                                             std::size_t target_size) {
+    std::vector<std::string_view> ranges;
+    std::size_t begin = 0;
+
+    while (data.size() - begin > target_size) {
+        // a game starts with an [Event tag after an empty line
+        std::size_t pos = begin + target_size;
+
+        while ((pos = data.find("\n[Event ", pos)) != std::string_view::npos) {
+            if (data[pos - 1] == '\n' || (data[pos - 1] == '\r' && data[pos - 2] == '\n')) {
+                break;
+            }
 
-    auto begin = pgns.begin();
-    auto end   = pgns.end();
+            pos++;
+        }
 
-    std::vector<std::vector<std::string>> chunks;
+        if (pos == std::string_view::npos) {
+            break;
+        }
 
-    while (begin != end) {
-        auto next =
-            std::next(begin, std::min(chunks_size, static_cast<int>(std::distance(begin, end))));
-        chunks.push_back(std::vector<std::string>(begin, next));
-        begin = next;
+        ranges.push_back(data.substr(begin, pos + 1 - begin));
+        begin = pos + 1;
     }
 
-    return chunks;
+    ranges.push_back(data.substr(begin));
+
+    return ranges;
 }
 
+/// @brief Set of revision SHAs, matching strings that end with one of them. This is what the
+/// regex ".*sha1|.*sha2|..." matches, without the cost of std::regex on hundreds of alternatives:
+/// a lookup of the suffix of each length present in the set. The set holds views of the SHAs,
+/// such that the suffixes are looked up without copying them.
+class RevisionSet {
+   public:
+    RevisionSet() = default;
+
+    RevisionSet(const RevisionSet &other) { *this = other; }
+
+    RevisionSet(RevisionSet &&other) = default;
+
+    RevisionSet &operator=(const RevisionSet &other) {
+        if (this != &other) {
+            shas.clear();
+            storage.clear();
+            lengths.clear();
+
+            for (const auto &sha : other.storage) {
+                add(sha);
+            }
+        }
+
+        return *this;
+    }
+
+    RevisionSet &operator=(RevisionSet &&other) = default;
+
+    /// @brief Add the whitespace separated SHAs in a stream.
+    /// @param in
+    void read(std::istream &in) {
+        std::string sha;
+
+        while (in >> sha) {
+            add(sha);
+        }
+    }
+
+    void add(const std::string &sha) {
+        if (sha.empty() || shas.count(sha) > 0) {
+            return;
+        }
+
+        // elements of a deque stay in place when it grows, the views stay valid
+        shas.insert(storage.emplace_back(sha));
+
+        if (std::find(lengths.begin(), lengths.end(), sha.size()) == lengths.end()) {
+            lengths.push_back(sha.size());
+        }
+    }
+
+    bool empty() const { return shas.empty(); }
+
+    std::size_t size() const { return shas.size(); }
+
+    /// @brief The SHAs in lexicographical order
+    /// @return
+    std::vector<std::string> sorted() const {
+        std::vector<std::string> sorted(storage.begin(), storage.end());
+        std::sort(sorted.begin(), sorted.end());
+        return sorted;
+    }
+
+    /// @brief Check if the string ends with one of the SHAs.
+    /// @param str
+    /// @return
+    bool matches(std::string_view str) const {
+        for (const auto length : lengths) {
+            if (length <= str.size() && shas.count(str.substr(str.size() - length)) > 0) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+   private:
+    std::unordered_set<std::string_view> shas;
+    std::deque<std::string> storage;
+    std::vector<std::size_t> lengths;
+};
+
 class CommandLine {
    public:
     CommandLine(int argc, char const *argv[]) {
@@ -200,6 +905,23 @@ class CommandLine {
         return default_value;
     }
 
+    /// @brief All parameters following an argument, up to the next argument starting with '-'.
+    /// @param arg
+    /// @return
+    std::vector<std::string> get_arguments(const std::string &arg) const {
+        auto it = std::find(args.begin(), args.end(), arg);
+
+        if (it == args.end()) {
+            return {};
+        }
+
+        const auto last = std::find_if(std::next(it), args.end(), [](const std::string &param) {
+            return !param.empty() && param.front() == '-';
+        });
+
+        return {std::next(it), last};
+    }
+
    private:
     std::vector<std::string> args;
 };
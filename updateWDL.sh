@@ -147,10 +147,8 @@ oldpawn=$(get_pawn_value "$oldnormdata")
 oldepoch=$(git show --quiet --format=%ci $firstrev)
 newepoch=$(git show --quiet --format=%ci $lastrev)
 
-# build a regex pattern to match all revisions
-regex_pattern=""
+# check that all revisions use the same NormalizeData
 for rev in $revs; do
-    regex_pattern="${regex_pattern}.*$rev|"
     newnormdata=$(get_normalize_data "$rev")
     if [[ "$oldnormdata" != "$newnormdata" ]]; then
         echo "Revision $rev has wrong NormalizeData ($newnormdata != $oldnormdata)"
@@ -158,21 +156,26 @@ for rev in $revs; do
     fi
 done
 
-# remove the trailing "|"
-regex_pattern="${regex_pattern%|}"
-
 cd ..
 
+# list all revisions in a file, to match them in the metadata and pgns
+echo "$revs" >matchrevs.txt
+
 # compile scoreWDLstat if needed
 make >&make.log
 
+# index the book FENs if needed, such that scoreWDLstat does not parse them on every run
+if [[ ! "$fixfen.gz.fixidx" -nt "$fixfen.gz" ]]; then
+    ./scoreWDLstat --fixFENsource "$fixfen.gz" --buildFixFENIndex >&fixfenindex.log
+fi
+
 echo "Look recursively in directory $pgnpath for games with max nElo" \
     "difference $EloDiffMax using" \
     "books matching \"$bookname\" for SF revisions between $firstrev (from" \
     "$oldepoch) and $lastrev (from $newepoch)."
 
 # obtain the WDL data from games of the SF revisions of interest
-./scoreWDLstat --dir $pgnpath -r --matchTC "60\+0.6" --matchThreads 1 --EloDiffMax $EloDiffMax --matchRev $regex_pattern --matchBook "$bookname" --fixFENsource "$fixfen.gz" -o updateWDL.json >&scoreWDLstat.log
+./scoreWDLstat --dir $pgnpath -r --matchTC "60\+0.6" --matchThreads 1 --EloDiffMax $EloDiffMax --matchRevFile matchrevs.txt --matchBook "$bookname" --fixFENsource "$fixfen.gz" --cacheDir wdlcache --metaIndex wdlmeta.idx --manifest wdlfiles.idx -o updateWDL.json >&scoreWDLstat.log
 
 gamescount=$(grep -o '[0-9]\+ games' scoreWDLstat.log | grep -o '[0-9]\+')
 